@@ -0,0 +1,170 @@
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <stdlib.h>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace {
+constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+// bytes the pools of all threads hold at most, past which a pool gives
+// back its least recently used size classes, or the freed block when it has
+// no other
+constexpr uint64_t MAX_CACHED_BYTES = 256ull << 20;
+// blocks of one size class a pool holds at most, about as many as a frame
+// has in use at once
+constexpr size_t MAX_CLASS_BLOCKS = 4;
+
+std::atomic<uint64_t> allocations{0};
+std::atomic<uint64_t> reuses{0};
+std::atomic<uint64_t> releases{0};
+std::atomic<uint64_t> cached_bytes{0};
+
+// sizes rounded up to one of 8 steps between powers of two, in multiples
+// of the alignment, and to whole huge pages from the huge page size
+size_t size_class(size_t size) {
+  size_t top = BUFFER_ALIGNMENT;
+  while (top <= size / 2)
+    top <<= 1;
+  size_t step = std::max(top / 8, BUFFER_ALIGNMENT);
+  if (size >= HUGE_PAGE_SIZE)
+    step = std::max(step, HUGE_PAGE_SIZE);
+  if (size > SIZE_MAX - step)
+    throw std::bad_alloc();
+  return std::max((size + step - 1) / step * step, BUFFER_ALIGNMENT);
+}
+
+void *system_allocate(size_t size) {
+  size_t alignment = size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : BUFFER_ALIGNMENT;
+#ifdef _WIN32
+  void *p = _aligned_malloc(size, alignment);
+#else
+  void *p = aligned_alloc(alignment, size);
+#endif
+  if (!p)
+    throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+  if (size >= HUGE_PAGE_SIZE)
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return p;
+}
+
+void system_free(void *p) {
+#ifdef _WIN32
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+  releases.fetch_add(1, std::memory_order_relaxed);
+}
+
+struct SizeClass {
+  std::vector<void *> blocks;
+  // pool clock of the last block taken or given back
+  uint64_t used = 0;
+};
+
+// free blocks of one thread by size class, given back when the thread exits
+struct Pool {
+  std::unordered_map<size_t, SizeClass> classes;
+  uint64_t clock = 0;
+
+  ~Pool();
+
+  void release(size_t size, SizeClass &c) {
+    for (void *p : c.blocks) {
+      system_free(p);
+      cached_bytes.fetch_sub(size, std::memory_order_relaxed);
+    }
+    c.blocks.clear();
+  }
+
+  // gives back the blocks of the least recently used size class other than
+  // keep, false when there is none
+  bool evict(size_t keep) {
+    auto oldest = classes.end();
+    for (auto it = classes.begin(); it != classes.end(); ++it) {
+      if (it->first != keep && !it->second.blocks.empty() &&
+          (oldest == classes.end() || it->second.used < oldest->second.used))
+        oldest = it;
+    }
+    if (oldest == classes.end())
+      return false;
+    release(oldest->first, oldest->second);
+    classes.erase(oldest);
+    return true;
+  }
+};
+
+thread_local Pool pool;
+// set once the pool of the thread is destroyed, when blocks freed by later
+// thread_local destructors go straight back to the system
+thread_local bool pool_destroyed = false;
+
+Pool::~Pool() {
+  for (auto &[size, c] : classes)
+    release(size, c);
+  pool_destroyed = true;
+}
+} // namespace
+
+void *buffer_allocate(size_t size) {
+  size = size_class(size);
+  if (pool_destroyed)
+    return system_allocate(size);
+  auto it = pool.classes.find(size);
+  if (it != pool.classes.end() && !it->second.blocks.empty()) {
+    void *p = it->second.blocks.back();
+    it->second.blocks.pop_back();
+    it->second.used = ++pool.clock;
+    cached_bytes.fetch_sub(size, std::memory_order_relaxed);
+    reuses.fetch_add(1, std::memory_order_relaxed);
+    return p;
+  }
+  return system_allocate(size);
+}
+
+void buffer_free(void *p, size_t size) {
+  if (!p)
+    return;
+  size = size_class(size);
+  if (pool_destroyed || size > MAX_CACHED_BYTES) {
+    system_free(p);
+    return;
+  }
+  try {
+    SizeClass &c = pool.classes[size];
+    c.used = ++pool.clock;
+    if (c.blocks.size() >= MAX_CLASS_BLOCKS) {
+      system_free(p);
+      return;
+    }
+    c.blocks.reserve(MAX_CLASS_BLOCKS);
+    while (cached_bytes.fetch_add(size, std::memory_order_relaxed) + size >
+           MAX_CACHED_BYTES) {
+      cached_bytes.fetch_sub(size, std::memory_order_relaxed);
+      if (!pool.evict(size)) {
+        system_free(p);
+        return;
+      }
+    }
+    c.blocks.push_back(p);
+  } catch (...) {
+    system_free(p);
+  }
+}
+
+BufferPoolStats buffer_pool_stats() {
+  return {allocations.load(std::memory_order_relaxed),
+          reuses.load(std::memory_order_relaxed),
+          releases.load(std::memory_order_relaxed),
+          cached_bytes.load(std::memory_order_relaxed)};
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// Buffers are aligned for any SIMD load and to cache lines
+constexpr size_t BUFFER_ALIGNMENT = 64;
+
+// Counters of the buffer pools of all threads
+struct BufferPoolStats {
+  // blocks allocated from the system
+  uint64_t allocations;
+  // blocks handed out again from a pool
+  uint64_t reuses;
+  // blocks given back to the system, past the cache limits or at thread
+  // exit
+  uint64_t releases;
+  // bytes of the blocks the pools hold for reuse
+  uint64_t cached_bytes;
+};
+
+// Uninitialized blocks of at least size bytes, aligned to BUFFER_ALIGNMENT.
+// Freed blocks are kept in a pool of the freeing thread, a few per size
+// class and up to a limit on the bytes all pools hold, past which the least
+// recently used classes are given back. They are handed out again for sizes
+// of the same size class, which are at most 1/8 apart. Blocks of 2 MiB and
+// more are aligned to and advised for huge pages where the system has them.
+void *buffer_allocate(size_t size);
+void buffer_free(void *p, size_t size);
+BufferPoolStats buffer_pool_stats();
+
+// Allocator of pooled blocks that leaves elements default initialized, so
+// vectors of samples are left uninitialized instead of zeroed
+template <typename T> struct PoolAllocator {
+  using value_type = T;
+
+  PoolAllocator() = default;
+  template <typename U> PoolAllocator(const PoolAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    if (n > SIZE_MAX / sizeof(T))
+      throw std::bad_array_new_length();
+    return static_cast<T *>(buffer_allocate(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t n) { buffer_free(p, n * sizeof(T)); }
+
+  template <typename U> void construct(U *p) { ::new ((void *)p) U; }
+  template <typename U, typename... Args>
+  void construct(U *p, Args &&...args) {
+    ::new ((void *)p) U(std::forward<Args>(args)...);
+  }
+
+  template <typename U> bool operator==(const PoolAllocator<U> &) const {
+    return true;
+  }
+  template <typename U> bool operator!=(const PoolAllocator<U> &) const {
+    return false;
+  }
+};
+
+template <typename T> using PooledVector = std::vector<T, PoolAllocator<T>>;
@@ -2,9 +2,17 @@
 
 #include "decoder_jpeg.h"
 #include "decoder_png.h"
+#include "decoder_ultrahdr.h"
+#include "jpeg_stream.h"
+#include "profiles.h"
 
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <unordered_map>
+
+// rows of the stripes ConvertColor transforms in parallel
+static constexpr uint32_t CONVERT_STRIPE_ROWS = 64;
 
 template <typename T>
 void unswizzle(const T *in, uint32_t stride, uint32_t planes_in, T **planes,
@@ -44,65 +52,233 @@ void copy_planar(const T *in, uint32_t stride, uint32_t planes_in, T **planes,
   }
 }
 
-static cmsToneCurve *Build_sRGBGamma() {
-  cmsFloat64Number Parameters[5];
+// Writes the width x height samples of a plane, step apart in rows of stride
+// samples, to a plane of out_width x out_height in the given EXIF
+// orientation. The samples go in square tiles, so a rotation doesn't walk
+// whole columns of either plane. Output past the turned samples repeats
+// the last row and column, keeping subsampling padding on the right and
+// bottom.
+template <typename T>
+void orient_plane(const T *in, size_t stride, size_t step, uint32_t width,
+                  uint32_t height, T *out, ptrdiff_t out_stride,
+                  uint32_t out_width, uint32_t out_height,
+                  uint32_t orientation) {
+  constexpr uint32_t TILE = 16;
+  ptrdiff_t w = width - 1;
+  ptrdiff_t h = height - 1;
+  ptrdiff_t s = out_stride;
+  // output offset of the first sample, and steps per input column and row
+  ptrdiff_t base = 0;
+  ptrdiff_t dx = 1;
+  ptrdiff_t dy = s;
+  switch (orientation) {
+  case 2:
+    base = w;
+    dx = -1;
+    dy = s;
+    break;
+  case 3:
+    base = h * s + w;
+    dx = -1;
+    dy = -s;
+    break;
+  case 4:
+    base = h * s;
+    dx = 1;
+    dy = -s;
+    break;
+  case 5:
+    base = 0;
+    dx = s;
+    dy = 1;
+    break;
+  case 6:
+    base = h;
+    dx = s;
+    dy = -1;
+    break;
+  case 7:
+    base = w * s + h;
+    dx = -s;
+    dy = -1;
+    break;
+  case 8:
+    base = w * s;
+    dx = -s;
+    dy = 1;
+    break;
+  }
 
-  Parameters[0] = 2.4;
-  Parameters[1] = 1. / 1.055;
-  Parameters[2] = 0.055 / 1.055;
-  Parameters[3] = 1. / 12.92;
-  Parameters[4] = 0.04045;
+  for (uint32_t ty = 0; ty < height; ty += TILE) {
+    uint32_t ey = std::min(ty + TILE, height);
+    for (uint32_t tx = 0; tx < width; tx += TILE) {
+      uint32_t ex = std::min(tx + TILE, width);
+      for (uint32_t y = ty; y < ey; y++) {
+        const T *src = in + y * stride + tx * step;
+        T *dst = out + base + y * dy + tx * dx;
+        for (uint32_t x = tx; x < ex; x++, src += step, dst += dx)
+          *dst = *src;
+      }
+    }
+  }
 
-  return cmsBuildParametricToneCurve(NULL, 4, Parameters);
+  uint32_t turned_width = orientation >= 5 ? height : width;
+  uint32_t turned_height = orientation >= 5 ? width : height;
+  for (uint32_t y = 0; y < out_height; y++) {
+    T *row = out + y * out_stride;
+    if (y >= turned_height) {
+      memcpy(row, out + (turned_height - 1) * out_stride,
+             out_width * sizeof(T));
+      continue;
+    }
+    for (uint32_t x = turned_width; x < out_width; x++)
+      row[x] = row[turned_width - 1];
+  }
 }
 
-static cmsHPROFILE create_sRGB_gray() {
-  cmsToneCurve *gamma22 = Build_sRGBGamma();
-  cmsCIExyY D65 = {0.3127, 0.3290, 1.0};
-  cmsHPROFILE profile = cmsCreateGrayProfile(&D65, gamma22);
-  cmsFreeToneCurve(gamma22);
-  return profile;
+// Writes decoded pixels to the planes of a frame in the given EXIF
+// orientation, in place of unswizzle and copy_planar
+template <typename T>
+void orient_planes(const T *in, const ImageInfo &info, uint32_t orientation,
+                   T **planes, ptrdiff_t *strides) {
+  uint32_t actual_width = info.actual_width ? info.actual_width : info.width;
+  uint32_t actual_height =
+      info.actual_height ? info.actual_height : info.height;
+  bool transposed = orientation >= 5;
+
+  for (uint32_t p = 0; p < info.components; p++) {
+    uint32_t ss_w = info.planar && p > 0 ? info.subsampling_w : 0;
+    uint32_t ss_h = info.planar && p > 0 ? info.subsampling_h : 0;
+    uint32_t w = info.width >> ss_w;
+    uint32_t h = info.height >> ss_h;
+    uint32_t aw = (actual_width + (1 << ss_w) - 1) >> ss_w;
+    uint32_t ah = (actual_height + (1 << ss_h) - 1) >> ss_h;
+    orient_plane<T>(in, info.planar ? w : (size_t)w * info.components,
+                    info.planar ? 1 : info.components, aw, ah, planes[p],
+                    strides[p], transposed ? h : w, transposed ? w : h,
+                    orientation);
+    in += info.planar ? (size_t)w * h : 1;
+  }
 }
 
-static const VSFrame *VS_CC imagesource_getframe(
-    int n, int activationReason, void *instanceData, void **frameData,
-    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-  auto d = static_cast<ImageSourceData *>(instanceData);
-
-  if (activationReason == arInitial) {
-    ImageInfo info = d->decoder->info;
+// Writes the luma of interleaved RGB or RGBA pixels to planes[0] and any
+// alpha to planes[1] in the same pass, with libjpeg's rgb_gray_convert
+// weights so the luma of RGB PNGs and JPEGs agree
+template <typename T>
+void unswizzle_luma(const T *in, uint32_t components, T **planes,
+                    ptrdiff_t *strides, uint32_t width, uint32_t height) {
+  for (uint32_t y = 0; y < height; y++) {
+    const T *src = in + (size_t)y * width * components;
+    T *luma = planes[0] + y * strides[0];
+    for (uint32_t x = 0; x < width; x++, src += components) {
+      luma[x] = (T)(((uint64_t)19595 * src[0] + (uint64_t)38470 * src[1] +
+                     (uint64_t)7471 * src[2] + 32768) >>
+                    16);
+    }
+    if (components == 4) {
+      T *alpha = planes[1] + y * strides[1];
+      for (uint32_t x = 0; x < width; x++)
+        alpha[x] = in[((size_t)y * width + x) * 4 + 3];
+    }
+  }
+}
 
-    VSFrame *dst = vsapi->newVideoFrame(&d->vi.format, info.width, info.height,
-                                        nullptr, core);
-    VSFrame *dst_alpha = nullptr;
+// The worker pool of a core, shared by its filters. It is made when a frame
+// first asks for it and the entry is erased when the core's last filter is
+// freed, so nothing is left for a later core at the same address.
+struct CorePool {
+  uint32_t filters = 0;
+  std::shared_ptr<ThreadPool> pool;
+};
+
+static std::mutex core_pools_mutex;
+static std::unordered_map<VSCore *, CorePool> core_pools;
+// the size SetThreads gave the pools of every core in the process, 0 for
+// the threads of each core
+static uint32_t pool_threads = 0;
+
+// Counts a filter of the core, before createVideoFilter
+static void acquire_core_pool(VSCore *core) {
+  std::lock_guard<std::mutex> lock(core_pools_mutex);
+  core_pools[core].filters++;
+}
 
-    uint8_t *planes[4] = {};
-    ptrdiff_t strides[4] = {};
+// Called by the free callbacks, joining the workers after the core's last
+// filter outside the lock
+static void release_core_pool(VSCore *core) {
+  std::shared_ptr<ThreadPool> pool;
+  std::lock_guard<std::mutex> lock(core_pools_mutex);
+  auto it = core_pools.find(core);
+  if (it == core_pools.end() || --it->second.filters > 0)
+    return;
+  pool = std::move(it->second.pool);
+  core_pools.erase(it);
+}
 
-    for (int p = 0; p < d->vi.format.numPlanes; p++) {
-      planes[p] = vsapi->getWritePtr(dst, p);
-      strides[p] = vsapi->getStride(dst, p) / d->vi.format.bytesPerSample;
+// Frames hold the pool while they use it, as SetThreads can replace it
+static std::shared_ptr<ThreadPool> core_pool(VSCore *core,
+                                             const VSAPI *vsapi) {
+  std::lock_guard<std::mutex> lock(core_pools_mutex);
+  CorePool &entry = core_pools[core];
+  if (!entry.pool) {
+    uint32_t threads = pool_threads;
+    if (threads == 0) {
+      VSCoreInfo info;
+      vsapi->getCoreInfo(core, &info);
+      threads = std::max(info.numThreads, 1);
     }
+    entry.pool = std::make_shared<ThreadPool>(threads);
+  }
+  return entry.pool;
+}
 
-    if (info.has_alpha) {
-      VSVideoFormat format_alpha = {};
-      vsapi->queryVideoFormat(&format_alpha, VSColorFamily::cfGray,
-                              d->vi.format.sampleType,
-                              d->vi.format.bitsPerSample, 0, 0, core);
+// Decodes an image into a new frame of the layout's format, with the
+// properties every source sets
+static VSFrame *decode_frame(BaseDecoder &decoder, const FrameLayout &layout,
+                             VSCore *core, const VSAPI *vsapi) {
+  ImageInfo info = decoder.info;
 
-      dst_alpha = vsapi->newVideoFrame(&format_alpha, info.width, info.height,
-                                       nullptr, core);
-      planes[d->vi.format.numPlanes] = vsapi->getWritePtr(dst_alpha, 0);
-      strides[d->vi.format.numPlanes] =
-          vsapi->getStride(dst_alpha, 0) / format_alpha.bytesPerSample;
+  VSFrame *dst = vsapi->newVideoFrame(&layout.vi.format, layout.vi.width,
+                                      layout.vi.height, nullptr, core);
+  VSFrame *dst_alpha = nullptr;
 
-      vsapi->mapSetInt(vsapi->getFramePropertiesRW(dst_alpha), "_ColorRange", 0,
-                       maReplace);
-    }
+  uint8_t *planes[4] = {};
+  ptrdiff_t strides[4] = {};
+
+  for (int p = 0; p < layout.vi.format.numPlanes; p++) {
+    planes[p] = vsapi->getWritePtr(dst, p);
+    strides[p] = vsapi->getStride(dst, p) / layout.vi.format.bytesPerSample;
+  }
+
+  if (info.has_alpha) {
+    VSVideoFormat format_alpha = {};
+    vsapi->queryVideoFormat(&format_alpha, VSColorFamily::cfGray,
+                            layout.vi.format.sampleType,
+                            layout.vi.format.bitsPerSample, 0, 0, core);
+
+    dst_alpha = vsapi->newVideoFrame(&format_alpha, layout.vi.width,
+                                     layout.vi.height, nullptr, core);
+    planes[layout.vi.format.numPlanes] = vsapi->getWritePtr(dst_alpha, 0);
+    strides[layout.vi.format.numPlanes] =
+        vsapi->getStride(dst_alpha, 0) / format_alpha.bytesPerSample;
+
+    vsapi->mapSetInt(vsapi->getFramePropertiesRW(dst_alpha), "_ColorRange", 0,
+                     maReplace);
+  }
 
-    cmsHPROFILE src_profile = d->decoder->get_color_profile();
+  VSMap *props = vsapi->getFramePropertiesRW(dst);
+
+  // samples with their own transfer, such as HDR ones, have no profile
+  if (info.transfer == 0) {
+    // luma computed from RGB samples isn't described by their profile, and
+    // is tagged like other gray images without one
+    cmsHPROFILE src_profile = decoder.get_color_profile();
+    if (layout.luma_only && src_profile &&
+        cmsGetColorSpace(src_profile) != cmsSigGrayData) {
+      src_profile = nullptr;
+    }
     if (!src_profile) {
-      if (d->vi.format.colorFamily == VSColorFamily::cfGray) {
+      if (layout.vi.format.colorFamily == VSColorFamily::cfGray) {
         src_profile = create_sRGB_gray();
       } else {
         src_profile = cmsCreate_sRGBProfile();
@@ -111,102 +287,380 @@ static const VSFrame *VS_CC imagesource_getframe(
 
     cmsUInt32Number out_length;
     cmsSaveProfileToMem(src_profile, NULL, &out_length);
-    std::vector<uint8_t> src_profile_bytes(out_length);
+    PooledVector<uint8_t> src_profile_bytes(out_length);
     cmsSaveProfileToMem(src_profile, src_profile_bytes.data(), &out_length);
 
-    VSMap *props = vsapi->getFramePropertiesRW(dst);
-
     vsapi->mapSetData(props, "ICCProfile",
                       reinterpret_cast<const char *>(src_profile_bytes.data()),
                       out_length, dtBinary, maAppend);
+  }
 
-    std::vector<uint8_t> pixels = d->decoder->decode();
-
-    if (info.color == VSColorFamily::cfYUV &&
-        (info.subsampling_w != 0 || info.subsampling_h != 0)) {
-      uint32_t w = info.width;
-      uint32_t h = info.height;
-      uint32_t pw = w >> info.subsampling_w;
-      uint32_t ph = h >> info.subsampling_h;
-      uint8_t *ptr = pixels.data();
-      if (info.bits == 32) {
-        copy_planar<uint32_t>((uint32_t *)ptr, w, 1,
-                              reinterpret_cast<uint32_t **>(&planes[0]),
-                              &strides[0], 1, h);
-        copy_planar<uint32_t>((uint32_t *)ptr + w * h, pw, 1,
-                              reinterpret_cast<uint32_t **>(&planes[1]),
-                              &strides[1], 1, ph);
-        copy_planar<uint32_t>((uint32_t *)ptr + w * h + pw * ph, pw, 1,
-                              reinterpret_cast<uint32_t **>(&planes[2]),
-                              &strides[2], 1, ph);
-      } else if (info.bits == 16) {
-        copy_planar<uint16_t>((uint16_t *)ptr, w, 1,
-                              reinterpret_cast<uint16_t **>(&planes[0]),
-                              &strides[0], 1, h);
-        copy_planar<uint16_t>((uint16_t *)ptr + w * h, pw, 1,
-                              reinterpret_cast<uint16_t **>(&planes[1]),
-                              &strides[1], 1, ph);
-        copy_planar<uint16_t>((uint16_t *)ptr + w * h + pw * ph, pw, 1,
-                              reinterpret_cast<uint16_t **>(&planes[2]),
-                              &strides[2], 1, ph);
-      } else {
-        copy_planar<uint8_t>(ptr, w, 1, &planes[0], &strides[0], 1, h);
-        copy_planar<uint8_t>(ptr + w * h, pw, 1, &planes[1], &strides[1], 1,
-                             ph);
-        copy_planar<uint8_t>(ptr + w * h + pw * ph, pw, 1, &planes[2],
-                             &strides[2], 1, ph);
-      }
+  std::shared_ptr<ThreadPool> pool = core_pool(core, vsapi);
+  decoder.pool = pool.get();
+  PooledVector<uint8_t> pixels = decoder.decode();
+
+  // RGB PNGs are reduced to luma in the pass that deinterleaves them, into
+  // planes of luma and alpha that are turned next for turned images
+  if (layout.luma && layout.orientation != 1) {
+    size_t plane = (size_t)info.width * info.height * (info.bits >> 3);
+    PooledVector<uint8_t> luma(plane * (info.has_alpha ? 2 : 1));
+    uint8_t *luma_planes[2] = {luma.data(), luma.data() + plane};
+    ptrdiff_t luma_strides[2] = {info.width, info.width};
+    if (info.bits == 16) {
+      unswizzle_luma<uint16_t>(
+          reinterpret_cast<uint16_t *>(pixels.data()), info.components,
+          reinterpret_cast<uint16_t **>(luma_planes), luma_strides,
+          info.width, info.height);
     } else {
-      if (info.bits == 32) {
-        unswizzle<uint32_t>((uint32_t *)pixels.data(),
-                            info.width * info.components, info.components,
-                            reinterpret_cast<uint32_t **>(planes), strides,
-                            info.components, info.width, info.height);
-      } else if (info.bits == 16) {
-        unswizzle<uint16_t>((uint16_t *)pixels.data(),
-                            info.width * info.components, info.components,
-                            reinterpret_cast<uint16_t **>(planes), strides,
-                            info.components, info.width, info.height);
-      } else {
-        unswizzle<uint8_t>(pixels.data(), info.width * info.components,
-                           info.components, planes, strides, info.components,
-                           info.width, info.height);
-      }
+      unswizzle_luma<uint8_t>(pixels.data(), info.components, luma_planes,
+                              luma_strides, info.width, info.height);
     }
+    pixels = std::move(luma);
+    info.components = info.has_alpha ? 2 : 1;
+    info.planar = true;
+  }
 
-    if (dst_alpha)
-      vsapi->mapConsumeFrame(props, "_Alpha", dst_alpha, maReplace);
-
-    if (d->vi.format.colorFamily == VSColorFamily::cfGray) {
-      vsapi->mapSetInt(props, "_Matrix", 2, maAppend);
-      vsapi->mapSetInt(props, "_Primaries", 2, maAppend);
-      vsapi->mapSetInt(props, "_Transfer", 2, maAppend);
-    } else if (d->vi.format.colorFamily == VSColorFamily::cfYUV) {
-      vsapi->mapSetInt(props, "_Matrix", info.yuv_matrix, maAppend);
-      vsapi->mapSetInt(props, "_Primaries", 1, maAppend);
-      vsapi->mapSetInt(props, "_Transfer", 1, maAppend);
+  if (layout.luma && layout.orientation == 1) {
+    if (info.bits == 16) {
+      unswizzle_luma<uint16_t>(
+          reinterpret_cast<uint16_t *>(pixels.data()), info.components,
+          reinterpret_cast<uint16_t **>(planes), strides, info.width,
+          info.height);
+    } else {
+      unswizzle_luma<uint8_t>(pixels.data(), info.components, planes, strides,
+                              info.width, info.height);
+    }
+  } else if (layout.orientation != 1) {
+    if (info.bits == 32) {
+      orient_planes<uint32_t>(reinterpret_cast<uint32_t *>(pixels.data()),
+                              info, layout.orientation,
+                              reinterpret_cast<uint32_t **>(planes), strides);
+    } else if (info.bits == 16) {
+      orient_planes<uint16_t>(reinterpret_cast<uint16_t *>(pixels.data()),
+                              info, layout.orientation,
+                              reinterpret_cast<uint16_t **>(planes), strides);
+    } else {
+      orient_planes<uint8_t>(pixels.data(), info, layout.orientation, planes,
+                             strides);
+    }
+  } else if (info.planar) {
+    uint32_t w = info.width;
+    uint32_t h = info.height;
+    uint32_t pw = w >> info.subsampling_w;
+    uint32_t ph = h >> info.subsampling_h;
+    uint8_t *ptr = pixels.data();
+    if (info.bits == 32) {
+      copy_planar<uint32_t>((uint32_t *)ptr, w, 1,
+                            reinterpret_cast<uint32_t **>(&planes[0]),
+                            &strides[0], 1, h);
+      copy_planar<uint32_t>((uint32_t *)ptr + w * h, pw, 1,
+                            reinterpret_cast<uint32_t **>(&planes[1]),
+                            &strides[1], 1, ph);
+      copy_planar<uint32_t>((uint32_t *)ptr + w * h + pw * ph, pw, 1,
+                            reinterpret_cast<uint32_t **>(&planes[2]),
+                            &strides[2], 1, ph);
+    } else if (info.bits == 16) {
+      copy_planar<uint16_t>((uint16_t *)ptr, w, 1,
+                            reinterpret_cast<uint16_t **>(&planes[0]),
+                            &strides[0], 1, h);
+      copy_planar<uint16_t>((uint16_t *)ptr + w * h, pw, 1,
+                            reinterpret_cast<uint16_t **>(&planes[1]),
+                            &strides[1], 1, ph);
+      copy_planar<uint16_t>((uint16_t *)ptr + w * h + pw * ph, pw, 1,
+                            reinterpret_cast<uint16_t **>(&planes[2]),
+                            &strides[2], 1, ph);
     } else {
-      vsapi->mapSetInt(props, "_Matrix", 0, maAppend);
-      vsapi->mapSetInt(props, "_Primaries", 1, maAppend);
-      vsapi->mapSetInt(props, "_Transfer", 1, maAppend);
+      copy_planar<uint8_t>(ptr, w, 1, &planes[0], &strides[0], 1, h);
+      copy_planar<uint8_t>(ptr + w * h, pw, 1, &planes[1], &strides[1], 1, ph);
+      copy_planar<uint8_t>(ptr + w * h + pw * ph, pw, 1, &planes[2],
+                           &strides[2], 1, ph);
     }
+  } else {
+    if (info.bits == 32) {
+      unswizzle<uint32_t>((uint32_t *)pixels.data(),
+                          info.width * info.components, info.components,
+                          reinterpret_cast<uint32_t **>(planes), strides,
+                          info.components, info.width, info.height);
+    } else if (info.bits == 16) {
+      unswizzle<uint16_t>((uint16_t *)pixels.data(),
+                          info.width * info.components, info.components,
+                          reinterpret_cast<uint16_t **>(planes), strides,
+                          info.components, info.width, info.height);
+    } else {
+      unswizzle<uint8_t>(pixels.data(), info.width * info.components,
+                         info.components, planes, strides, info.components,
+                         info.width, info.height);
+    }
+  }
+
+  if (dst_alpha)
+    vsapi->mapConsumeFrame(props, "_Alpha", dst_alpha, maReplace);
+
+  if (info.transfer != 0) {
+    vsapi->mapSetInt(props, "_Matrix", 0, maAppend);
+    vsapi->mapSetInt(props, "_Primaries", info.primaries, maAppend);
+    vsapi->mapSetInt(props, "_Transfer", info.transfer, maAppend);
+  } else if (layout.vi.format.colorFamily == VSColorFamily::cfGray) {
+    vsapi->mapSetInt(props, "_Matrix", 2, maAppend);
+    vsapi->mapSetInt(props, "_Primaries", 2, maAppend);
+    vsapi->mapSetInt(props, "_Transfer", 2, maAppend);
+  } else if (layout.vi.format.colorFamily == VSColorFamily::cfYUV) {
+    vsapi->mapSetInt(props, "_Matrix", info.yuv_matrix, maAppend);
+    vsapi->mapSetInt(props, "_Primaries", 1, maAppend);
+    vsapi->mapSetInt(props, "_Transfer", 1, maAppend);
+  } else {
+    vsapi->mapSetInt(props, "_Matrix", 0, maAppend);
+    vsapi->mapSetInt(props, "_Primaries", 1, maAppend);
+    vsapi->mapSetInt(props, "_Transfer", 1, maAppend);
+  }
+
+  vsapi->mapSetInt(props, "_ColorRange", 0, maAppend);
+  std::string format = decoder.get_name();
+  vsapi->mapSetData(props, "ImageFormat", format.c_str(), (int)format.size(),
+                    dtUtf8, maAppend);
+
+  if ((decoder.info.actual_width != 0 || decoder.info.actual_height != 0) &&
+      (decoder.info.actual_width != decoder.info.width ||
+       decoder.info.actual_height != decoder.info.height)) {
+    bool transposed = layout.orientation >= 5;
+    vsapi->mapSetInt(props, "ActualWidth",
+                     transposed ? decoder.info.actual_height
+                                : decoder.info.actual_width,
+                     maAppend);
+    vsapi->mapSetInt(props, "ActualHeight",
+                     transposed ? decoder.info.actual_width
+                                : decoder.info.actual_height,
+                     maAppend);
+  }
+
+  return dst;
+}
+
+static J_DCT_METHOD get_jpeg_speed(const VSMap *in, const VSAPI *vsapi) {
+  int err = 0;
+  const char *jpeg_speed_s = vsapi->mapGetData(in, "jpeg_speed", 0, &err);
+  if (err)
+    return JDCT_ISLOW;
+  std::string speed = std::string(jpeg_speed_s);
+  if (speed == "fast")
+    return JDCT_IFAST;
+  if (speed == "float")
+    return JDCT_FLOAT;
+  if (speed != "accurate")
+    throw std::runtime_error("jpeg_speed: Must be accurate, fast or float");
+  return JDCT_ISLOW;
+}
+
+// Sets up a single frame clip of the decoded image, turned by orientation
+static void init_layout(FrameLayout &layout, const ImageInfo &info,
+                        uint32_t orientation, bool luma_only, VSCore *core,
+                        const VSAPI *vsapi) {
+  layout.luma_only = luma_only;
+  // the JPEG decoder outputs luma itself
+  layout.luma = luma_only && info.color == VSColorFamily::cfRGB;
+  layout.orientation = orientation;
+  // orientations 5 to 8 turn the image by a quarter
+  bool transposed = orientation >= 5;
+
+  layout.vi = {
+      .format = {},
+      .fpsNum = 1,
+      .fpsDen = 1,
+      .width = (int)(transposed ? info.height : info.width),
+      .height = (int)(transposed ? info.width : info.height),
+      .numFrames = 1,
+  };
+
+  vsapi->queryVideoFormat(
+      &layout.vi.format, layout.luma ? VSColorFamily::cfGray : info.color,
+      info.sample_type, info.bits,
+      transposed ? info.subsampling_h : info.subsampling_w,
+      transposed ? info.subsampling_w : info.subsampling_h, core);
+}
+
+static std::vector<uint8_t> read_file(const std::string &path) {
+  std::ifstream file(path, std::ios_base::binary);
+  if (!file.good()) {
+    throw std::runtime_error("File not found");
+  }
+  file.unsetf(std::ios::skipws);
+  file.seekg(0, std::ios::end);
+  size_t filesize = file.tellg();
+  file.seekg(0, std::ios::beg);
+  std::vector<uint8_t> data(filesize);
+  file.read(reinterpret_cast<char *>(data.data()), filesize);
+  return data;
+}
+
+// Reads the start of a file in growing chunks until it holds the header of
+// the image, which is all opening a decoder reads, or the whole file when
+// the header can't be found
+static std::vector<uint8_t> read_header(const std::string &path) {
+  std::ifstream file(path, std::ios_base::binary);
+  if (!file.good()) {
+    throw std::runtime_error("File not found");
+  }
+  std::vector<uint8_t> data;
+  size_t chunk = 64 * 1024;
+  while (file) {
+    size_t size = data.size();
+    data.resize(size + chunk);
+    file.read(reinterpret_cast<char *>(data.data() + size), chunk);
+    data.resize(size + (size_t)file.gcount());
+
+    bool png = data.size() >= 8 && PngDecoder::is_png(data.data());
+    bool jpeg = data.size() >= 3 && JpegDecoder::is_jpeg(data.data());
+    if (png ? PngDecoder::header_size(data) > 0
+        : jpeg ? JpegDecoder::header_size(data) > 0
+               : data.size() >= 8)
+      break;
+    chunk *= 2;
+  }
+  return data;
+}
+
+// Reads size bytes at offset of a file, false if they can't be read
+static bool read_file_range(const std::string &path, uint64_t offset,
+                            size_t size, std::vector<uint8_t> *data) {
+  std::ifstream file(path, std::ios_base::binary);
+  file.seekg(offset);
+  data->resize(size);
+  file.read(reinterpret_cast<char *>(data->data()), size);
+  return !!file;
+}
 
-    vsapi->mapSetInt(props, "_ColorRange", 0, maAppend);
-    std::string format = d->decoder->get_name();
-    vsapi->mapSetData(props, "ImageFormat", format.c_str(), (int)format.size(),
-                      dtUtf8, maAppend);
+// Whether two images decode to frames of the same size and format
+static bool same_format(const ImageInfo &a, const ImageInfo &b) {
+  return a.width == b.width && a.height == b.height && a.color == b.color &&
+         a.bits == b.bits && a.subsampling_w == b.subsampling_w &&
+         a.subsampling_h == b.subsampling_h && a.has_alpha == b.has_alpha;
+}
 
-    if ((d->decoder->info.actual_width != 0 ||
-         d->decoder->info.actual_height != 0) &&
-        (d->decoder->info.actual_width != d->decoder->info.width ||
-         d->decoder->info.actual_height != d->decoder->info.height)) {
-      vsapi->mapSetInt(props, "ActualWidth", d->decoder->info.actual_width,
-                       maAppend);
-      vsapi->mapSetInt(props, "ActualHeight", d->decoder->info.actual_height,
-                       maAppend);
+// What open_image reads of the file and opens a decoder for
+enum class OpenMode {
+  // the header, for a decoder that gives the image's info but can't decode
+  // it
+  header,
+  // the whole file for the image's info, without the threads and indexes
+  // decoding needs
+  probe,
+  decode,
+};
+
+// Reads the file of a source and opens its decoder
+static void open_image(const ImageSourceData &d, OpenMode mode,
+                       ImageFile *image) {
+  image->data =
+      mode == OpenMode::header ? read_header(d.path) : read_file(d.path);
+  bool probe = mode != OpenMode::decode;
+
+  if (PngDecoder::is_png(image->data.data())) {
+    PngOptions png = d.png;
+    if (probe) {
+      png.index_rows = 0;
+      png.index.clear();
+    }
+    auto decoder = std::make_unique<PngDecoder>(
+        &image->data, png.trusted, png.preview, png.band_top, png.band_height,
+        png.index_rows, png.index,
+        d.png_indexes.get(0, image->data));
+    d.png_indexes.put(0, decoder->shared_index());
+    image->decoder = std::move(decoder);
+  } else if (JpegDecoder::is_jpeg(image->data.data())) {
+    JpegOptions jpeg = d.jpeg;
+    if (probe) {
+      jpeg.threads = 1;
+      jpeg.index_rows = 0;
+      jpeg.index.clear();
+    }
+    // the thumbnail replaces the file, which is decoded at 1/8 of its size
+    // from the DC coefficients instead when it has none
+    uint32_t orientation = 0;
+    if (d.jpeg_thumbnail) {
+      std::vector<uint8_t> thumbnail =
+          JpegDecoder::exif_thumbnail(&image->data, &orientation);
+      if (!thumbnail.empty()) {
+        image->data = std::move(thumbnail);
+      } else {
+        jpeg.preview_dc = true;
+        orientation = 0;
+      }
+    }
+    std::vector<uint8_t> gainmap;
+    GainMapMetadata metadata;
+    if (!d.jpeg_gainmap.empty() &&
+        !UltraHdrDecoder::find_gainmap(image->data, &gainmap, &metadata))
+      throw std::runtime_error("jpeg_gainmap: No gain map");
+    // an index a frame request built is reused by the later ones
+    auto base =
+        open_jpeg(jpeg, &image->data, d.jpeg_indexes.get(0, image->data));
+    d.jpeg_indexes.put(0, base->shared_index());
+    if (!d.jpeg_gainmap.empty()) {
+      image->decoder = std::make_unique<UltraHdrDecoder>(
+          &image->data, std::move(base), std::move(gainmap), metadata,
+          d.jpeg_gainmap == "pq");
+    } else {
+      image->decoder = std::move(base);
     }
+    if (orientation != 0)
+      image->decoder->info.orientation = orientation;
+  } else {
+    throw std::runtime_error("file format unrecognized ");
+  }
+}
 
-    return dst;
+// The bytes of an image of an MPF file
+static std::vector<uint8_t> mpf_image(const std::vector<uint8_t> &data,
+                                      const MpfImage &image) {
+  auto begin = data.begin() + image.offset;
+  return std::vector<uint8_t>(begin, begin + image.size);
+}
+
+// The layout of an image of an MPF file, which is turned by its own EXIF
+// orientation
+static FrameLayout mpf_layout(const ImageSourceData &d,
+                              const BaseDecoder &decoder, VSCore *core,
+                              const VSAPI *vsapi) {
+  FrameLayout layout;
+  init_layout(layout, decoder.info,
+              d.exif_orientation ? decoder.info.orientation : 1, d.luma_only,
+              core, vsapi);
+  return layout;
+}
+
+static const VSFrame *VS_CC imagesource_getframe(
+    int n, int activationReason, void *instanceData, void **frameData,
+    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+  auto d = static_cast<ImageSourceData *>(instanceData);
+
+  if (activationReason == arInitial) {
+    try {
+      if (!d->images.empty()) {
+        std::vector<uint8_t> data;
+        if (!read_file_range(d->path, d->images[n].offset,
+                             d->images[n].size, &data))
+          throw std::runtime_error("Failed to read image");
+        auto decoder = open_jpeg(d->jpeg, &data, d->jpeg_indexes.get(n, data));
+        d->jpeg_indexes.put(n, decoder->shared_index());
+        return decode_frame(*decoder, mpf_layout(*d, *decoder, core, vsapi),
+                            core, vsapi);
+      }
+
+      // every request reads the file and decodes it with its own decoder,
+      // so requests decode in parallel and the clip holds nothing between
+      // them
+      ImageFile image;
+      open_image(*d, OpenMode::decode, &image);
+      const ImageInfo &info = image.decoder->info;
+      if (!same_format(info, d->info) ||
+          info.orientation != d->info.orientation)
+        throw std::runtime_error("File changed since the clip was created");
+      return decode_frame(*image.decoder, *d, core, vsapi);
+    } catch (const std::exception &e) {
+      vsapi->setFilterError(
+          (std::string("ImageSource: ") + e.what()).c_str(), frameCtx);
+      return nullptr;
+    }
   }
 
   return nullptr;
@@ -216,6 +670,7 @@ static void VS_CC imagesource_free(void *instanceData, VSCore *core,
                                    const VSAPI *vsapi) {
   auto d = static_cast<ImageSourceData *>(instanceData);
   delete d;
+  release_core_pool(core);
 }
 
 void VS_CC imagesource_create(const VSMap *in, VSMap *out, void *userData,
@@ -230,6 +685,46 @@ void VS_CC imagesource_create(const VSMap *in, VSMap *out, void *userData,
   if (err)
     subsampling_pad = true;
 
+  bool trusted = !!vsapi->mapGetInt(in, "trusted", 0, &err);
+  if (err)
+    trusted = false;
+
+  uint32_t png_preview = vsapi->mapGetIntSaturated(in, "png_preview", 0, &err);
+  if (err)
+    png_preview = 0;
+  if (png_preview != 0 && png_preview != 1 && png_preview != 3 &&
+      png_preview != 5) {
+    throw std::runtime_error("png_preview: Must be 0, 1, 3 or 5");
+  }
+
+  uint32_t band_top = vsapi->mapGetIntSaturated(in, "band_top", 0, &err);
+  if (err)
+    band_top = 0;
+
+  uint32_t band_height =
+      vsapi->mapGetIntSaturated(in, "band_height", 0, &err);
+  if (err)
+    band_height = 0;
+
+  std::string png_index;
+  const char *png_index_s = vsapi->mapGetData(in, "png_index", 0, &err);
+  if (!err)
+    png_index = std::string(png_index_s);
+
+  uint32_t png_index_rows =
+      vsapi->mapGetIntSaturated(in, "png_index_rows", 0, &err);
+  if (err)
+    png_index_rows = 0;
+
+  bool exif_orientation =
+      !!vsapi->mapGetInt(in, "exif_orientation", 0, &err);
+  if (err)
+    exif_orientation = false;
+
+  bool luma_only = !!vsapi->mapGetInt(in, "luma_only", 0, &err);
+  if (err)
+    luma_only = false;
+
   bool jpeg_rgb = !!vsapi->mapGetInt(in, "jpeg_rgb", 0, &err);
   if (err)
     jpeg_rgb = false;
@@ -239,65 +734,146 @@ void VS_CC imagesource_create(const VSMap *in, VSMap *out, void *userData,
   if (err)
     jpeg_fancy_upsampling = true;
 
-  const char *jpeg_cmyk_profile =
-      vsapi->mapGetData(in, "jpeg_cmyk_profile", 0, &err);
-  cmsHPROFILE cmyk_profile = nullptr;
+  uint32_t jpeg_threads =
+      vsapi->mapGetIntSaturated(in, "jpeg_threads", 0, &err);
+  if (err)
+    jpeg_threads = 1;
+
+  bool jpeg_pipeline = !!vsapi->mapGetInt(in, "jpeg_pipeline", 0, &err);
+  if (err)
+    jpeg_pipeline = false;
+
+  uint32_t jpeg_bits = vsapi->mapGetIntSaturated(in, "jpeg_bits", 0, &err);
+  if (err)
+    jpeg_bits = 8;
+  if (jpeg_bits != 8 && jpeg_bits != 16 && jpeg_bits != 32)
+    throw std::runtime_error("jpeg_bits: Must be 8, 16 or 32");
+
+  J_DCT_METHOD jpeg_speed = get_jpeg_speed(in, vsapi);
+
+  uint32_t jpeg_preview =
+      vsapi->mapGetIntSaturated(in, "jpeg_preview", 0, &err);
+  if (err)
+    jpeg_preview = 0;
+
+  bool jpeg_preview_dc = !!vsapi->mapGetInt(in, "jpeg_preview_dc", 0, &err);
+  if (err)
+    jpeg_preview_dc = false;
+
+  bool jpeg_thumbnail = !!vsapi->mapGetInt(in, "jpeg_thumbnail", 0, &err);
+  if (err)
+    jpeg_thumbnail = false;
+
+  uint32_t jpeg_max_memory =
+      vsapi->mapGetIntSaturated(in, "jpeg_max_memory", 0, &err);
+  if (err)
+    jpeg_max_memory = 0;
+
+  std::string jpeg_index;
+  const char *jpeg_index_s = vsapi->mapGetData(in, "jpeg_index", 0, &err);
+  if (!err)
+    jpeg_index = std::string(jpeg_index_s);
+
+  uint32_t jpeg_index_rows =
+      vsapi->mapGetIntSaturated(in, "jpeg_index_rows", 0, &err);
+  if (err)
+    jpeg_index_rows = 0;
+  // an index describes the whole file, not its thumbnail
+  if (jpeg_thumbnail && (!jpeg_index.empty() || jpeg_index_rows > 0))
+    throw std::runtime_error("jpeg_thumbnail: Can't be used with jpeg_index");
+
+  std::string jpeg_gainmap;
+  const char *jpeg_gainmap_s = vsapi->mapGetData(in, "jpeg_gainmap", 0, &err);
   if (!err) {
-    cmyk_profile = cmsOpenProfileFromFile(jpeg_cmyk_profile, "r");
-    if (!cmyk_profile) {
-      throw std::runtime_error("jpeg_cmyk_profile: Bad profile");
-    }
-    if (cmsGetColorSpace(cmyk_profile) != cmsSigCmykData) {
-      throw std::runtime_error("jpeg_cmyk_profile: Not CMYK profile");
-    }
+    jpeg_gainmap = std::string(jpeg_gainmap_s);
+    if (jpeg_gainmap != "linear" && jpeg_gainmap != "pq")
+      throw std::runtime_error("jpeg_gainmap: Must be linear or pq");
+    // the gain map covers the whole base image in color
+    if (band_top > 0 || band_height > 0 || luma_only || jpeg_preview_dc ||
+        jpeg_thumbnail)
+      throw std::runtime_error("jpeg_gainmap: Can't be used with band_top, "
+                               "band_height, luma_only, jpeg_preview_dc or "
+                               "jpeg_thumbnail");
   }
+
+  bool jpeg_mpf = !!vsapi->mapGetInt(in, "jpeg_mpf", 0, &err);
+  if (err)
+    jpeg_mpf = false;
+  // the images have their own indexes and thumbnails
+  if (jpeg_mpf && (!jpeg_index.empty() || jpeg_thumbnail ||
+                   !jpeg_gainmap.empty()))
+    throw std::runtime_error("jpeg_mpf: Can't be used with jpeg_index, "
+                             "jpeg_thumbnail or jpeg_gainmap");
+
+  std::string jpeg_cmyk_profile;
+  const char *jpeg_cmyk_profile_s =
+      vsapi->mapGetData(in, "jpeg_cmyk_profile", 0, &err);
+  if (!err)
+    jpeg_cmyk_profile = std::string(jpeg_cmyk_profile_s);
+
+  std::string jpeg_cmyk_target_profile;
   const char *jpeg_cmyk_target_profile_s =
       vsapi->mapGetData(in, "jpeg_cmyk_target_profile", 0, &err);
-  cmsHPROFILE cmyk_target_profile = nullptr;
-  if (!err) {
-    std::string jpeg_cmyk_target_profile =
-        std::string(jpeg_cmyk_target_profile_s);
-    if (jpeg_cmyk_target_profile == "srgb") {
-      cmyk_target_profile = cmsCreate_sRGBProfile();
-    } else {
-      cmyk_target_profile =
-          cmsOpenProfileFromFile(jpeg_cmyk_target_profile_s, "r");
-      if (!cmyk_target_profile) {
-        throw std::runtime_error("jpeg_cmyk_target_profile: Bad profile");
-      }
-      if (cmsGetColorSpace(cmyk_target_profile) != cmsSigRgbData) {
-        throw std::runtime_error("jpeg_cmyk_target_profile: Not RGB profile");
-      }
-    }
-  }
-
-  {
-    std::ifstream file(file_path, std::ios_base::binary);
-    if (!file.good()) {
-      throw std::runtime_error("File not found");
-    }
-    file.unsetf(std::ios::skipws);
-    file.seekg(0, std::ios::end);
-    size_t filesize = file.tellg();
-    file.seekg(0, std::ios::beg);
-    d->data.resize(filesize);
-    file.read(reinterpret_cast<char *>(d->data.data()), filesize);
+  if (!err)
+    jpeg_cmyk_target_profile = std::string(jpeg_cmyk_target_profile_s);
+
+  d->path = file_path;
+  d->png = {
+      .trusted = trusted,
+      .preview = png_preview,
+      .band_top = band_top,
+      .band_height = band_height,
+      .index_rows = png_index_rows,
+      .index = png_index,
+  };
+  d->jpeg = {
+      .subsampling_pad = subsampling_pad,
+      .rgb = jpeg_rgb,
+      .fancy_upsampling = jpeg_fancy_upsampling,
+      .cmyk_profile = jpeg_cmyk_profile,
+      .cmyk_target_profile = jpeg_cmyk_target_profile,
+      .band_top = band_top,
+      .band_height = band_height,
+      .threads = jpeg_threads,
+      .pipeline = jpeg_pipeline,
+      .index_rows = jpeg_index_rows,
+      .index = jpeg_index,
+      .bits = jpeg_bits,
+      .dct_method = jpeg_speed,
+      .preview = jpeg_preview,
+      .preview_dc = jpeg_preview_dc,
+      .max_memory = (size_t)jpeg_max_memory << 20,
+      .luma_only = luma_only,
+  };
+  d->jpeg_thumbnail = jpeg_thumbnail;
+  d->jpeg_gainmap = jpeg_gainmap;
+  if (!jpeg_gainmap.empty()) {
+    // the gain map is applied to float RGB
+    d->jpeg.rgb = true;
+    d->jpeg.bits = 32;
   }
 
-  if (PngDecoder::is_png(d->data.data())) {
-    d->decoder = std::make_unique<PngDecoder>(&d->data);
-  } else if (JpegDecoder::is_jpeg(d->data.data())) {
-    d->decoder = std::make_unique<JpegDecoder>(
-        &d->data, subsampling_pad, jpeg_rgb, jpeg_fancy_upsampling,
-        cmyk_profile, cmyk_target_profile);
-  } else {
-    throw std::runtime_error("file format unrecognized ");
+  // a clip of one image is set up from the header of the file, which is
+  // read when the frame is requested. The images of an MPF file and gain
+  // maps are found past the first image.
+  ImageFile image;
+  open_image(*d,
+             jpeg_mpf || !jpeg_gainmap.empty() ? OpenMode::probe
+                                               : OpenMode::header,
+             &image);
+
+  // a file of one image is decoded like any other JPEG
+  if (jpeg_mpf && JpegDecoder::is_jpeg(image.data.data())) {
+    d->images = JpegDecoder::mpf_images(image.data);
+    if (d->images.size() < 2)
+      d->images.clear();
   }
 
-  ImageInfo info = d->decoder->info;
+  ImageInfo info = image.decoder->info;
+  d->info = info;
 
 #ifdef LOG_IMAGEINFO
-  std::cout << "decoder " << d->decoder->get_name() << std::endl
+  std::cout << "decoder " << image.decoder->get_name() << std::endl
             << "width " << info.width << std::endl
             << "height " << info.height << std::endl
             << "actual width " << info.actual_width << std::endl
@@ -308,24 +884,158 @@ void VS_CC imagesource_create(const VSMap *in, VSMap *out, void *userData,
             << "sample_type " << info.sample_type << std::endl
             << "bits " << info.bits << std::endl
             << "subsampling_w " << info.subsampling_w << std::endl
-            << "subsampling_h " << info.subsampling_h << std::endl;
+            << "subsampling_h " << info.subsampling_h << std::endl
+            << "orientation " << info.orientation << std::endl;
 #endif
 
-  d->vi = {
-      .format = {},
-      .fpsNum = 1,
-      .fpsDen = 1,
-      .width = (int)info.width,
-      .height = (int)info.height,
-      .numFrames = 1,
-  };
-
-  vsapi->queryVideoFormat(&d->vi.format, info.color, info.sample_type,
-                          info.bits, info.subsampling_w, info.subsampling_h,
-                          core);
+  d->exif_orientation = exif_orientation;
+  init_layout(*d, info, exif_orientation ? info.orientation : 1, luma_only,
+              core, vsapi);
+
+  if (!d->images.empty()) {
+    // the images can differ in size and format, which makes a clip of
+    // variable size or format. Reading their headers only needs a decoder
+    // without threads.
+    JpegOptions probe = d->jpeg;
+    probe.threads = 1;
+    probe.index_rows = 0;
+    for (size_t i = 1; i < d->images.size(); i++) {
+      std::vector<uint8_t> data = mpf_image(image.data, d->images[i]);
+      FrameLayout layout = mpf_layout(*d, *open_jpeg(probe, &data), core,
+                                      vsapi);
+      if (layout.vi.width != d->vi.width ||
+          layout.vi.height != d->vi.height) {
+        d->vi.width = 0;
+        d->vi.height = 0;
+      }
+      if (!vsh::isSameVideoFormat(&layout.vi.format, &d->vi.format))
+        d->vi.format = {};
+    }
+    d->vi.numFrames = (int)d->images.size();
+  }
 
+  // frames are decoded by their own decoders
+  acquire_core_pool(core);
   vsapi->createVideoFilter(out, "ImageSource", &d->vi, imagesource_getframe,
-                           imagesource_free, fmUnordered, nullptr, 0, d, core);
+                           imagesource_free, fmParallel, nullptr, 0, d, core);
+}
+
+static const VSFrame *VS_CC mjpegsource_getframe(
+    int n, int activationReason, void *instanceData, void **frameData,
+    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+  auto d = static_cast<MjpegSourceData *>(instanceData);
+
+  if (activationReason == arInitial) {
+    try {
+      // every request reads its own JPEG, so frames decode in parallel
+      auto [offset, size] = d->frames[n];
+      std::vector<uint8_t> data;
+      if (!read_file_range(d->path, offset, size, &data))
+        throw std::runtime_error("Failed to read frame");
+
+      // the marker index doesn't check the entropy coded data, a corrupt
+      // frame fails here instead
+      auto decoder = open_jpeg(d->jpeg, &data);
+      if (!same_format(decoder->info, d->info))
+        throw std::runtime_error(
+            "Frame doesn't match the format of the first frame");
+
+      VSFrame *dst = decode_frame(*decoder, *d, core, vsapi);
+      VSMap *props = vsapi->getFramePropertiesRW(dst);
+      vsapi->mapSetInt(props, "_DurationNum", d->vi.fpsDen, maReplace);
+      vsapi->mapSetInt(props, "_DurationDen", d->vi.fpsNum, maReplace);
+      return dst;
+    } catch (const std::exception &e) {
+      vsapi->setFilterError(
+          (std::string("MJPEGSource: ") + e.what()).c_str(), frameCtx);
+      return nullptr;
+    }
+  }
+
+  return nullptr;
+}
+
+static void VS_CC mjpegsource_free(void *instanceData, VSCore *core,
+                                   const VSAPI *vsapi) {
+  auto d = static_cast<MjpegSourceData *>(instanceData);
+  delete d;
+  release_core_pool(core);
+}
+
+void VS_CC mjpegsource_create(const VSMap *in, VSMap *out, void *userData,
+                              VSCore *core, const VSAPI *vsapi) {
+  MjpegSourceData *d = new MjpegSourceData();
+
+  d->path = vsapi->mapGetData(in, "source", 0, NULL);
+
+  int err = 0;
+
+  int64_t fpsnum = vsapi->mapGetInt(in, "fpsnum", 0, &err);
+  if (err)
+    fpsnum = 25;
+
+  int64_t fpsden = vsapi->mapGetInt(in, "fpsden", 0, &err);
+  if (err)
+    fpsden = 1;
+  if (fpsnum <= 0 || fpsden <= 0)
+    throw std::runtime_error("fpsnum, fpsden: Must be positive");
+
+  d->jpeg.subsampling_pad =
+      !!vsapi->mapGetInt(in, "subsampling_pad", 0, &err);
+  if (err)
+    d->jpeg.subsampling_pad = true;
+
+  d->jpeg.luma_only = !!vsapi->mapGetInt(in, "luma_only", 0, &err);
+  if (err)
+    d->jpeg.luma_only = false;
+
+  d->jpeg.rgb = !!vsapi->mapGetInt(in, "jpeg_rgb", 0, &err);
+  if (err)
+    d->jpeg.rgb = false;
+
+  d->jpeg.fancy_upsampling =
+      !!vsapi->mapGetInt(in, "jpeg_fancy_upsampling", 0, &err);
+  if (err)
+    d->jpeg.fancy_upsampling = true;
+
+  d->jpeg.bits = vsapi->mapGetIntSaturated(in, "jpeg_bits", 0, &err);
+  if (err)
+    d->jpeg.bits = 8;
+  if (d->jpeg.bits != 8 && d->jpeg.bits != 16 && d->jpeg.bits != 32)
+    throw std::runtime_error("jpeg_bits: Must be 8, 16 or 32");
+
+  d->jpeg.dct_method = get_jpeg_speed(in, vsapi);
+
+  {
+    std::ifstream file(d->path, std::ios_base::binary);
+    if (!file.good()) {
+      throw std::runtime_error("File not found");
+    }
+    d->frames = index_jpeg_stream(file);
+  }
+  if (d->frames.empty())
+    throw std::runtime_error("No JPEGs found");
+  if (d->frames.size() > INT32_MAX)
+    throw std::runtime_error("Too many JPEGs");
+
+  // the first JPEG gives the format of the clip
+  {
+    auto [offset, size] = d->frames[0];
+    std::vector<uint8_t> data;
+    if (!read_file_range(d->path, offset, size, &data))
+      throw std::runtime_error("Failed to read the first JPEG");
+    d->info = open_jpeg(d->jpeg, &data)->info;
+  }
+
+  init_layout(*d, d->info, 1, d->jpeg.luma_only, core, vsapi);
+  d->vi.numFrames = (int)d->frames.size();
+  vsh::reduceRational(&fpsnum, &fpsden);
+  d->vi.fpsNum = fpsnum;
+  d->vi.fpsDen = fpsden;
+
+  acquire_core_pool(core);
+  vsapi->createVideoFilter(out, "MJPEGSource", &d->vi, mjpegsource_getframe,
+                           mjpegsource_free, fmParallel, nullptr, 0, d, core);
 }
 
 static const VSFrame *VS_CC convertcolor_getframe(
@@ -380,14 +1090,6 @@ static const VSFrame *VS_CC convertcolor_getframe(
     int n_in_planes = d->src_vi->format.numPlanes;
     int n_out_planes = d->vi.format.numPlanes;
 
-    std::vector<uint8_t> pixels(d->vi.width * d->vi.height * n_in_planes *
-                                d->src_vi->format.bytesPerSample);
-    std::vector<uint8_t> pixels2(d->vi.width * d->vi.height * n_out_planes * 4);
-    std::vector<uint8_t> pixels3;
-    if (!d->float_output)
-      pixels3.resize(d->vi.width * d->vi.height * n_out_planes *
-                     d->vi.format.bytesPerSample);
-
     const uint8_t *src_planes[4] = {};
     ptrdiff_t src_strides[4] = {};
 
@@ -408,22 +1110,6 @@ static const VSFrame *VS_CC convertcolor_getframe(
 
     // TODO: alpha
 
-    if (d->src_vi->format.bytesPerSample == 4) {
-      swizzle<uint32_t>(reinterpret_cast<const uint32_t **>(src_planes),
-                        src_strides, n_in_planes, (uint32_t *)pixels.data(),
-                        d->vi.width * n_in_planes, n_in_planes, d->vi.width,
-                        d->vi.height);
-    } else if (d->src_vi->format.bytesPerSample == 2) {
-      swizzle<uint16_t>(reinterpret_cast<const uint16_t **>(src_planes),
-                        src_strides, n_in_planes, (uint16_t *)pixels.data(),
-                        d->vi.width * n_in_planes, n_in_planes, d->vi.width,
-                        d->vi.height);
-    } else {
-      swizzle<uint8_t>(src_planes, src_strides, n_in_planes, pixels.data(),
-                       d->vi.width * n_in_planes, n_in_planes, d->vi.width,
-                       d->vi.height);
-    }
-
     bool is_gray = d->src_vi->format.numPlanes == 1;
     bool is_float = d->src_vi->format.sampleType == VSSampleType::stFloat;
     bool is_16 = d->src_vi->format.bitsPerSample == 16;
@@ -456,7 +1142,7 @@ static const VSFrame *VS_CC convertcolor_getframe(
     } else {
       cmsUInt32Number out_length;
       cmsSaveProfileToMem(d->target_profile, NULL, &out_length);
-      std::vector<uint8_t> target_profile_bytes(out_length);
+      PooledVector<uint8_t> target_profile_bytes(out_length);
       cmsSaveProfileToMem(d->target_profile, target_profile_bytes.data(),
                           &out_length);
 
@@ -495,10 +1181,13 @@ static const VSFrame *VS_CC convertcolor_getframe(
 
     cmsUInt32Number rendering_intent = cmsGetHeaderRenderingIntent(src_profile);
 
-    cmsHTRANSFORM transform = cmsCreateTransform(
-        src_profile, intype, d->target_profile,
-        outtype_intermediate | PLANAR_SH(1), rendering_intent,
-        cmsFLAGS_HIGHRESPRECALC | cmsFLAGS_BLACKPOINTCOMPENSATION);
+    std::unique_ptr<void, decltype(&cmsDeleteTransform)> transform(
+        cmsCreateTransform(src_profile, intype, d->target_profile,
+                           outtype_intermediate | PLANAR_SH(1),
+                           rendering_intent,
+                           cmsFLAGS_HIGHRESPRECALC |
+                               cmsFLAGS_BLACKPOINTCOMPENSATION),
+        cmsDeleteTransform);
 
     if (!d->input_profile) {
       cmsCloseProfile(src_profile);
@@ -508,40 +1197,83 @@ static const VSFrame *VS_CC convertcolor_getframe(
       throw std::runtime_error("invalid transform");
     }
 
-    cmsDoTransform(transform, pixels.data(), pixels2.data(),
-                   d->vi.width * d->vi.height);
-
-    cmsDeleteTransform(transform);
-
-    uint8_t *out_pointer = pixels2.data();
-
+    std::unique_ptr<void, decltype(&cmsDeleteTransform)> transform2(
+        nullptr, cmsDeleteTransform);
     if (!d->float_output) {
-      cmsHTRANSFORM transform2 = cmsCreateTransform(
+      transform2.reset(cmsCreateTransform(
           d->target_profile, outtype_intermediate | PLANAR_SH(1),
           d->target_profile, outtype | PLANAR_SH(1), rendering_intent,
-          cmsFLAGS_HIGHRESPRECALC | cmsFLAGS_BLACKPOINTCOMPENSATION);
+          cmsFLAGS_HIGHRESPRECALC | cmsFLAGS_BLACKPOINTCOMPENSATION));
+    }
 
-      cmsDoTransform(transform2, pixels2.data(), pixels3.data(),
-                     d->vi.width * d->vi.height);
+    // stripes of rows go through the transforms in parallel, each in
+    // buffers of its own
+    size_t in_bytes = d->src_vi->format.bytesPerSample;
+    size_t out_bytes = d->vi.format.bytesPerSample;
+    auto convert = [&](uint32_t top, uint32_t bottom) {
+      uint32_t rows = bottom - top;
+      size_t count = (size_t)d->vi.width * rows;
+      PooledVector<uint8_t> pixels(count * n_in_planes * in_bytes);
+      PooledVector<uint8_t> pixels2(count * n_out_planes * 4);
+      PooledVector<uint8_t> pixels3;
+      if (!d->float_output)
+        pixels3.resize(count * n_out_planes * out_bytes);
+
+      const uint8_t *stripe_src[4] = {};
+      uint8_t *stripe_dst[4] = {};
+      for (int plane = 0; plane < n_in_planes; plane++)
+        stripe_src[plane] =
+            src_planes[plane] + src_strides[plane] * in_bytes * top;
+      for (int plane = 0; plane < n_out_planes; plane++)
+        stripe_dst[plane] =
+            dst_planes[plane] + dst_strides[plane] * out_bytes * top;
+
+      if (in_bytes == 4) {
+        swizzle<uint32_t>(reinterpret_cast<const uint32_t **>(stripe_src),
+                          src_strides, n_in_planes, (uint32_t *)pixels.data(),
+                          d->vi.width * n_in_planes, n_in_planes, d->vi.width,
+                          rows);
+      } else if (in_bytes == 2) {
+        swizzle<uint16_t>(reinterpret_cast<const uint16_t **>(stripe_src),
+                          src_strides, n_in_planes, (uint16_t *)pixels.data(),
+                          d->vi.width * n_in_planes, n_in_planes, d->vi.width,
+                          rows);
+      } else {
+        swizzle<uint8_t>(stripe_src, src_strides, n_in_planes, pixels.data(),
+                         d->vi.width * n_in_planes, n_in_planes, d->vi.width,
+                         rows);
+      }
 
-      cmsDeleteTransform(transform2);
+      cmsDoTransform(transform.get(), pixels.data(), pixels2.data(), count);
 
-      out_pointer = pixels3.data();
-    }
+      uint8_t *out_pointer = pixels2.data();
 
-    if (d->vi.format.bytesPerSample == 4) {
-      copy_planar<uint32_t>(reinterpret_cast<uint32_t *>(out_pointer),
-                            d->vi.width, n_out_planes,
-                            reinterpret_cast<uint32_t **>(dst_planes),
-                            dst_strides, n_out_planes, d->vi.height);
-    } else if (d->vi.format.bytesPerSample == 2) {
-      copy_planar<uint16_t>(reinterpret_cast<uint16_t *>(out_pointer),
-                            d->vi.width, n_out_planes,
-                            reinterpret_cast<uint16_t **>(dst_planes),
-                            dst_strides, n_out_planes, d->vi.height);
-    } else {
-      throw std::runtime_error("This function should not be producing 8 bit");
-    }
+      if (!d->float_output) {
+        cmsDoTransform(transform2.get(), pixels2.data(), pixels3.data(),
+                       count);
+        out_pointer = pixels3.data();
+      }
+
+      if (out_bytes == 4) {
+        copy_planar<uint32_t>(reinterpret_cast<uint32_t *>(out_pointer),
+                              d->vi.width, n_out_planes,
+                              reinterpret_cast<uint32_t **>(stripe_dst),
+                              dst_strides, n_out_planes, rows);
+      } else if (out_bytes == 2) {
+        copy_planar<uint16_t>(reinterpret_cast<uint16_t *>(out_pointer),
+                              d->vi.width, n_out_planes,
+                              reinterpret_cast<uint16_t **>(stripe_dst),
+                              dst_strides, n_out_planes, rows);
+      } else {
+        throw std::runtime_error(
+            "This function should not be producing 8 bit");
+      }
+    };
+
+    std::shared_ptr<ThreadPool> pool = core_pool(core, vsapi);
+    parallel_for(pool.get(), 0, d->vi.height,
+                 (d->vi.height + CONVERT_STRIPE_ROWS - 1) / CONVERT_STRIPE_ROWS,
+                 convert);
 
     return dst;
   }
@@ -563,6 +1295,7 @@ static void VS_CC convertcolor_free(void *instanceData, VSCore *core,
   }
 
   delete d;
+  release_core_pool(core);
 }
 
 void VS_CC convertcolor_create(const VSMap *in, VSMap *out, void *userData,
@@ -671,10 +1404,50 @@ void VS_CC convertcolor_create(const VSMap *in, VSMap *out, void *userData,
                           core);
 
   VSFilterDependency deps[]{{d->node, rpStrictSpatial}};
+  acquire_core_pool(core);
   vsapi->createVideoFilter(out, "ConvertColor", &d->vi, convertcolor_getframe,
                            convertcolor_free, fmUnordered, deps, 1, d, core);
 }
 
+static void VS_CC bufferstats_create(const VSMap *in, VSMap *out,
+                                     void *userData, VSCore *core,
+                                     const VSAPI *vsapi) {
+  BufferPoolStats stats = buffer_pool_stats();
+  vsapi->mapSetInt(out, "allocations", stats.allocations, maReplace);
+  vsapi->mapSetInt(out, "reuses", stats.reuses, maReplace);
+  vsapi->mapSetInt(out, "releases", stats.releases, maReplace);
+  vsapi->mapSetInt(out, "cached_bytes", stats.cached_bytes, maReplace);
+}
+
+static void VS_CC setthreads_create(const VSMap *in, VSMap *out,
+                                    void *userData, VSCore *core,
+                                    const VSAPI *vsapi) {
+  int err = 0;
+  int64_t threads = vsapi->mapGetInt(in, "threads", 0, &err);
+  if (!err && threads < 0)
+    throw std::runtime_error("threads: Must be 0 or more");
+
+  std::vector<std::shared_ptr<ThreadPool>> pools;
+  std::lock_guard<std::mutex> lock(core_pools_mutex);
+  if (!err) {
+    pool_threads = (uint32_t)std::min<int64_t>(threads, UINT32_MAX);
+    // frames still running on the old pools hold them until they finish,
+    // and the next frame of each core makes one of the new size
+    for (auto &entry : core_pools) {
+      if (entry.second.pool)
+        pools.push_back(std::move(entry.second.pool));
+    }
+  }
+
+  uint32_t size = pool_threads;
+  if (size == 0) {
+    VSCoreInfo info;
+    vsapi->getCoreInfo(core, &info);
+    size = std::max(info.numThreads, 1);
+  }
+  vsapi->mapSetInt(out, "threads", size, maReplace);
+}
+
 VS_EXTERNAL_API(void)
 VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI *vspapi) {
   vspapi->configPlugin("moe.grass.carefulsource", "cs", "carefulsource",
@@ -683,15 +1456,54 @@ VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI *vspapi) {
   vspapi->registerFunction("ImageSource",
                            "source:data;"
                            "subsampling_pad:int:opt;"
+                           "trusted:int:opt;"
+                           "exif_orientation:int:opt;"
+                           "luma_only:int:opt;"
+                           "band_top:int:opt;"
+                           "band_height:int:opt;"
+                           "png_preview:int:opt;"
+                           "png_index:data:opt;"
+                           "png_index_rows:int:opt;"
                            "jpeg_rgb:int:opt;"
                            "jpeg_fancy_upsampling:int:opt;"
+                           "jpeg_threads:int:opt;"
+                           "jpeg_pipeline:int:opt;"
+                           "jpeg_bits:int:opt;"
+                           "jpeg_speed:data:opt;"
+                           "jpeg_preview:int:opt;"
+                           "jpeg_preview_dc:int:opt;"
+                           "jpeg_thumbnail:int:opt;"
+                           "jpeg_mpf:int:opt;"
+                           "jpeg_gainmap:data:opt;"
+                           "jpeg_max_memory:int:opt;"
+                           "jpeg_index:data:opt;"
+                           "jpeg_index_rows:int:opt;"
                            "jpeg_cmyk_profile:data:opt;"
                            "jpeg_cmyk_target_profile:data:opt;",
                            "clip:vnode;", imagesource_create, nullptr, plugin);
+  vspapi->registerFunction("MJPEGSource",
+                           "source:data;"
+                           "fpsnum:int:opt;"
+                           "fpsden:int:opt;"
+                           "subsampling_pad:int:opt;"
+                           "luma_only:int:opt;"
+                           "jpeg_rgb:int:opt;"
+                           "jpeg_fancy_upsampling:int:opt;"
+                           "jpeg_bits:int:opt;"
+                           "jpeg_speed:data:opt;",
+                           "clip:vnode;", mjpegsource_create, nullptr, plugin);
   vspapi->registerFunction("ConvertColor",
                            "clip:vnode;"
                            "output_profile:data;"
                            "input_profile:data:opt;"
                            "float_output:int:opt;",
                            "clip:vnode;", convertcolor_create, nullptr, plugin);
+  vspapi->registerFunction("BufferStats", "",
+                           "allocations:int;"
+                           "reuses:int;"
+                           "releases:int;"
+                           "cached_bytes:int;",
+                           bufferstats_create, nullptr, plugin);
+  vspapi->registerFunction("SetThreads", "threads:int:opt;", "threads:int;",
+                           setthreads_create, nullptr, plugin);
 }
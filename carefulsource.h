@@ -1,16 +1,105 @@
 #pragma once
 
+#include "content_hash.h"
 #include "decoder_base.h"
+#include "decoder_jpeg.h"
+#include "exif.h"
+#include "jpeg_index.h"
+#include "png_index.h"
 
 #include "VSHelper4.h"
 #include "VapourSynth4.h"
+#include "jpeglib.h"
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 
-struct ImageSourceData final {
+// How decoded images are written to the frames of a source
+struct FrameLayout {
+  VSVideoInfo vi;
+  // EXIF orientation applied to frames, 1 to leave them as stored
+  uint32_t orientation = 1;
+  bool luma_only = false;
+  // RGB pixels are reduced to luma while writing the planes
+  bool luma = false;
+};
+
+// Options of the PNG decoders a source opens
+struct PngOptions {
+  bool trusted = false;
+  uint32_t preview = 0;
+  uint32_t band_top = 0;
+  uint32_t band_height = 0;
+  uint32_t index_rows = 0;
+  std::string index;
+};
+
+// A file opened by one frame request and the decoder reading it
+struct ImageFile {
   std::vector<uint8_t> data;
   std::unique_ptr<BaseDecoder> decoder;
-  VSVideoInfo vi;
+};
+
+// In-memory indexes built by the first frame request that needs one and
+// shared by the later ones, per frame. Every request reads the file again,
+// so an index is only handed out for data with the content_hash it was
+// built from, and a file that changed gets a new one.
+template <typename Index> class IndexCache {
+private:
+  std::mutex mutex;
+  std::unordered_map<int, std::shared_ptr<const Index>> indexes;
+
+public:
+  std::shared_ptr<const Index> get(int n, const std::vector<uint8_t> &data) {
+    std::shared_ptr<const Index> index;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = indexes.find(n);
+      if (it == indexes.end())
+        return nullptr;
+      index = it->second;
+    }
+    // hashed outside the lock, as other requests hash their own files
+    if (index->hash() != content_hash(data))
+      return nullptr;
+    return index;
+  }
+
+  void put(int n, std::shared_ptr<const Index> index) {
+    if (!index)
+      return;
+    std::lock_guard<std::mutex> lock(mutex);
+    indexes[n] = std::move(index);
+  }
+};
+
+// Set up when the clip is created and only read by frame requests, which
+// open their own files and decoders and share the indexes they build
+struct ImageSourceData final : FrameLayout {
+  std::string path;
+  // the image the clip was created from, which a file opened again has to
+  // match
+  ImageInfo info;
+  // images of a Multi-Picture Format JPEG, one per frame, each read from
+  // the file and decoded by its own decoder
+  std::vector<MpfImage> images;
+  PngOptions png;
+  JpegOptions jpeg;
+  bool jpeg_thumbnail = false;
+  std::string jpeg_gainmap;
+  bool exif_orientation = false;
+  mutable IndexCache<JpegIndex> jpeg_indexes;
+  mutable IndexCache<PngIndex> png_indexes;
+};
+
+struct MjpegSourceData final : FrameLayout {
+  std::string path;
+  // offset and size of each JPEG in the file
+  std::vector<std::pair<uint64_t, uint64_t>> frames;
+  // the first JPEG, which every frame has to match
+  ImageInfo info;
+  JpegOptions jpeg;
 };
 
 struct ConvertColorData final {
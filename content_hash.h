@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// 64 bit hash of every byte of a file, which an index keeps to tell whether
+// the file it is used with is the one it was built from. It takes 8 bytes a
+// step, so hashing costs little next to reading the file.
+inline uint64_t content_hash(const std::vector<uint8_t> &data) {
+  const uint64_t k = 0x9e3779b97f4a7c15;
+  uint64_t h = data.size() * k;
+  size_t i = 0;
+  for (; i + 8 <= data.size(); i += 8) {
+    uint64_t word;
+    memcpy(&word, data.data() + i, 8);
+    h = ((h << 29 | h >> 35) ^ word) * k;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data.data() + i, data.size() - i);
+  h = ((h << 29 | h >> 35) ^ tail) * k;
+
+  // spreads the high bits the multiplies leave over all of them
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccd;
+  h ^= h >> 33;
+  return h;
+}
@@ -0,0 +1,171 @@
+// Decode speed of the jpeg_speed tiers, with the error of the fast and float
+// tiers against accurate decoding, and of PNGs with and without trusted
+//
+//   decode_bench [-r repeats] files...
+//
+// Every file is decoded repeats times (default 5) per setting, JPEGs to RGB,
+// and the fastest decode is reported in megapixels per second. PSNR is over
+// all samples of the tier's output against the accurate output. Trusted PNG
+// output has to match the checked output.
+
+#include "decoder_jpeg.h"
+#include "decoder_png.h"
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string.h>
+
+namespace {
+std::vector<uint8_t> read_file(const std::string &path) {
+  std::ifstream file(path, std::ios_base::binary);
+  if (!file.good())
+    throw std::runtime_error("File not found");
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {});
+}
+
+// Fastest of repeats decodes by decoders open makes, with the output of the
+// last one
+template <typename Open>
+double best_seconds(uint32_t repeats, Open open, PooledVector<uint8_t> *out) {
+  double best = INFINITY;
+  for (uint32_t i = 0; i < repeats; i++) {
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<BaseDecoder> decoder = open();
+    *out = decoder->decode();
+    std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, seconds.count());
+  }
+  return best;
+}
+
+// PSNR of 8 or 16 bit little endian samples, CMYK JPEGs decode to 16 bits
+double psnr(const PooledVector<uint8_t> &a, const PooledVector<uint8_t> &b,
+            uint32_t bits) {
+  if (a.size() != b.size())
+    throw std::runtime_error("Outputs differ in size");
+  size_t bytes = bits == 8 ? 1 : 2;
+  size_t count = a.size() / bytes;
+  double sum = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint16_t x = a[i * bytes];
+    uint16_t y = b[i * bytes];
+    if (bytes == 2) {
+      x |= a[i * 2 + 1] << 8;
+      y |= b[i * 2 + 1] << 8;
+    }
+    double d = (double)x - y;
+    sum += d * d;
+  }
+  if (sum == 0)
+    return INFINITY;
+  double peak = (1 << bits) - 1;
+  return 10 * std::log10(peak * peak * count / sum);
+}
+
+void report(const std::string &name, const ImageInfo &info, double seconds) {
+  double megapixels = (double)info.width * info.height / 1e6;
+  std::cout << "  " << std::left << std::setw(10) << name << std::right
+            << std::setw(9) << megapixels / seconds << " MP/s";
+}
+
+void bench_jpeg(std::vector<uint8_t> &data, uint32_t repeats) {
+  struct Tier {
+    const char *name;
+    J_DCT_METHOD dct_method;
+  };
+  static const Tier tiers[] = {{"accurate", JDCT_ISLOW},
+                               {"fast", JDCT_IFAST},
+                               {"float", JDCT_FLOAT}};
+
+  PooledVector<uint8_t> accurate;
+  for (const Tier &tier : tiers) {
+    JpegOptions options;
+    options.rgb = true;
+    options.dct_method = tier.dct_method;
+    ImageInfo info;
+    PooledVector<uint8_t> out;
+    double seconds = best_seconds(
+        repeats,
+        [&] {
+          auto decoder = open_jpeg(options, &data);
+          info = decoder->info;
+          return decoder;
+        },
+        &out);
+
+    report(tier.name, info, seconds);
+    if (tier.dct_method == JDCT_ISLOW) {
+      accurate = std::move(out);
+    } else {
+      std::cout << std::setw(9) << psnr(accurate, out, info.bits)
+                << " dB PSNR";
+    }
+    std::cout << std::endl;
+  }
+}
+
+void bench_png(std::vector<uint8_t> &data, uint32_t repeats) {
+  PooledVector<uint8_t> checked;
+  for (bool trusted : {false, true}) {
+    ImageInfo info;
+    PooledVector<uint8_t> out;
+    double seconds = best_seconds(
+        repeats,
+        [&] {
+          auto decoder = std::make_unique<PngDecoder>(&data, trusted, 0, 0, 0,
+                                                      0, "", nullptr);
+          info = decoder->info;
+          return decoder;
+        },
+        &out);
+
+    report(trusted ? "trusted" : "checked", info, seconds);
+    if (!trusted) {
+      checked = std::move(out);
+    } else if (out.size() != checked.size() ||
+               memcmp(out.data(), checked.data(), out.size()) != 0) {
+      std::cout << std::endl;
+      throw std::runtime_error("Trusted output differs");
+    }
+    std::cout << std::endl;
+  }
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  uint32_t repeats = 5;
+  int first = 1;
+  if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+    repeats = std::max(atoi(argv[2]), 1);
+    first = 3;
+  }
+  if (first >= argc) {
+    std::cerr << "usage: decode_bench [-r repeats] files..." << std::endl;
+    return 2;
+  }
+
+  std::cout << std::fixed << std::setprecision(2);
+
+  int result = 0;
+  for (int i = first; i < argc; i++) {
+    std::cout << argv[i] << std::endl;
+    try {
+      std::vector<uint8_t> data = read_file(argv[i]);
+      if (data.size() >= 8 && JpegDecoder::is_jpeg(data.data())) {
+        bench_jpeg(data, repeats);
+      } else if (data.size() >= 8 && PngDecoder::is_png(data.data())) {
+        bench_png(data, repeats);
+      } else {
+        throw std::runtime_error("Not a JPEG or PNG");
+      }
+    } catch (const std::exception &e) {
+      std::cout << "  " << e.what() << std::endl;
+      result = 1;
+    }
+  }
+  return result;
+}
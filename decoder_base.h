@@ -1,7 +1,9 @@
 #pragma once
 
 #include "VapourSynth4.h"
+#include "buffer_pool.h"
 #include "lcms2.h"
+#include "thread_pool.h"
 #include <memory>
 #include <stdint.h>
 #include <string>
@@ -14,12 +16,20 @@ struct ImageInfo final {
   uint32_t actual_height = 0;
   uint32_t components;
   bool has_alpha = false;
+  // samples are stored plane after plane instead of interleaved
+  bool planar = false;
   VSColorFamily color;
   VSSampleType sample_type;
   uint32_t bits;
   uint32_t subsampling_w = 0;
   uint32_t subsampling_h = 0;
   int yuv_matrix = 1;
+  // EXIF orientation of the decoded image, which is left as stored
+  uint32_t orientation = 1;
+  // transfer and primaries as in the _Transfer and _Primaries frame
+  // properties for samples no ICC profile describes, 0 for others
+  uint32_t transfer = 0;
+  uint32_t primaries = 0;
 };
 
 class BaseDecoder {
@@ -30,8 +40,11 @@ public:
 
   ImageInfo info;
   std::vector<uint8_t> *m_data;
+  // workers for the parallel parts of decoding, which run on the calling
+  // thread without one
+  ThreadPool *pool = nullptr;
 
-  virtual std::vector<uint8_t> decode() = 0;
+  virtual PooledVector<uint8_t> decode() = 0;
   virtual cmsHPROFILE get_color_profile() = 0;
   virtual std::string get_name() = 0;
 };
@@ -1,8 +1,16 @@
 #include "decoder_jpeg.h"
 #include "cmyk.h"
+#include "jpeg_dsp.h"
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
 #include <iostream>
+#include <mutex>
+#include <string.h>
+#include <type_traits>
 
-JpegDecodeSession::JpegDecodeSession(std::vector<uint8_t> *data) {
+JpegDecodeSession::JpegDecodeSession(std::vector<uint8_t> *data,
+                                     size_t max_memory) {
   jinfo.err = jpeg_std_error(&jerr);
   int rc;
 
@@ -13,7 +21,9 @@ JpegDecodeSession::JpegDecodeSession(std::vector<uint8_t> *data) {
   };
 
   jpeg_create_decompress(&jinfo);
+  coefficients = std::make_unique<JpegCoefficients>(&jinfo, max_memory);
   jpeg_mem_src(&jinfo, data->data(), (uint32_t)data->size());
+  jpeg_save_markers(&jinfo, JPEG_APP0 + 1, 0xFFFF);
   jpeg_save_markers(&jinfo, JPEG_APP0 + 2, 0xFFFF);
   rc = jpeg_read_header(&jinfo, true);
 
@@ -55,16 +65,212 @@ cmsHPROFILE JpegDecodeSession::get_color_profile() {
   return src_profile;
 }
 
+const uint8_t *JpegDecodeSession::exif(size_t *size) {
+  static const uint8_t prefix[] = {'E', 'x', 'i', 'f', 0, 0};
+  for (auto *m = jinfo.marker_list; m; m = m->next) {
+    if (m->marker == JPEG_APP0 + 1 && m->data_length > sizeof(prefix) &&
+        memcmp(m->data, prefix, sizeof(prefix)) == 0) {
+      *size = m->data_length - sizeof(prefix);
+      return m->data + sizeof(prefix);
+    }
+  }
+  return nullptr;
+}
+
+const uint8_t *JpegDecodeSession::xmp(size_t *size) {
+  static const char prefix[] = "http://ns.adobe.com/xap/1.0/";
+  for (auto *m = jinfo.marker_list; m; m = m->next) {
+    if (m->marker == JPEG_APP0 + 1 && m->data_length > sizeof(prefix) &&
+        memcmp(m->data, prefix, sizeof(prefix)) == 0) {
+      *size = m->data_length - sizeof(prefix);
+      return m->data + sizeof(prefix);
+    }
+  }
+  return nullptr;
+}
+
+// rows of CMYK samples libjpeg's scanlines are read into before going to RGB,
+// and of the stripes the CMYK samples of a whole image go to RGB in
+static constexpr uint32_t CMYK_STRIPE_ROWS = 64;
+
+namespace {
+// Maps samples of the JPEG's precision to 16 bit or float output, with
+// chroma centered like the pipeline's
+void precision_scale(j_decompress_ptr dinfo, uint32_t bits, float *scale,
+                     float *offset) {
+  float max = (float)((1 << dinfo->data_precision) - 1);
+  float half = (float)(1 << (dinfo->data_precision - 1));
+  for (int c = 0; c < dinfo->out_color_components; c++) {
+    bool chroma = dinfo->out_color_space == JCS_YCbCr && c > 0;
+    scale[c] = (bits == 32 ? 1.f : 65535.f) / max;
+    offset[c] = !chroma      ? 0
+                : bits == 32 ? -half / max
+                             : 32768 - half * scale[c];
+  }
+}
+
+// Writes count samples of nc interleaved components, scaled by component
+void store_scaled(const uint16_t *in, uint8_t *out, size_t count, int nc,
+                  uint32_t bits, const float *scale, const float *offset) {
+  for (size_t i = 0; i < count; i++) {
+    float v = in[i] * scale[i % nc] + offset[i % nc];
+    if (bits == 16) {
+      reinterpret_cast<uint16_t *>(out)[i] =
+          (uint16_t)(std::min(std::max(v, 0.f), 65535.f) + 0.5f);
+    } else {
+      reinterpret_cast<float *>(out)[i] = v;
+    }
+  }
+}
+
+// Reads a row of samples at the JPEG's precision, through libjpeg-turbo 3's
+// 12 and 16 bit interfaces past 8 bits
+void read_wide_row(j_decompress_ptr dinfo, uint16_t *row,
+                   PooledVector<uint8_t> &narrow) {
+  if (dinfo->data_precision <= 8) {
+    JSAMPROW p = narrow.data();
+    jpeg_read_scanlines(dinfo, &p, 1);
+    for (size_t i = 0; i < narrow.size(); i++)
+      row[i] = narrow[i];
+    return;
+  }
+#if LIBJPEG_TURBO_VERSION_NUMBER >= 3000000
+  if (dinfo->data_precision <= 12) {
+    J12SAMPROW p = reinterpret_cast<J12SAMPROW>(row);
+    jpeg12_read_scanlines(dinfo, &p, 1);
+  } else {
+    J16SAMPROW p = row;
+    jpeg16_read_scanlines(dinfo, &p, 1);
+  }
+#else
+  throw std::runtime_error("JPEGs of more than 8 bits need libjpeg-turbo 3");
+#endif
+}
+
+// Finds the SOS marker of the first scan a preview of the given number of
+// scans leaves out, or returns 0 when the preview needs the whole file.
+// Without a scan count, a DC preview stops after the scans that start the
+// DC coefficients of every component.
+size_t preview_end(const std::vector<uint8_t> &data, uint32_t scans,
+                   bool dc) {
+  size_t pos = 2;
+  uint32_t components = 0;
+  uint32_t seen = 0;
+  uint32_t dc_seen = 0;
+  bool has_dc[256] = {};
+
+  while (pos < data.size() && data[pos] == 0xFF) {
+    while (pos < data.size() && data[pos] == 0xFF)
+      pos++;
+    if (pos + 3 > data.size() || data[pos] == 0xD9)
+      return 0;
+
+    uint8_t marker = data[pos];
+    size_t length = (data[pos + 1] << 8) | data[pos + 2];
+    if (length < 2 || pos + 1 + length > data.size())
+      return 0;
+    const uint8_t *p = data.data() + pos + 3;
+
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+        marker != 0xC8 && marker != 0xCC && length >= 8) {
+      components = p[5];
+    } else if (marker == 0xDA) {
+      bool done = scans > 0 ? seen >= scans
+                            : dc && components > 0 && dc_seen >= components;
+      if (done)
+        return pos - 1;
+      seen++;
+
+      uint32_t count = p[0];
+      if (length < 6 + count * 2)
+        return 0;
+      uint8_t ss = p[1 + count * 2];
+      uint8_t ah = p[3 + count * 2] >> 4;
+      for (uint32_t i = 0; i < count && ss == 0 && ah == 0; i++) {
+        if (!has_dc[p[1 + i * 2]]) {
+          has_dc[p[1 + i * 2]] = true;
+          dc_seen++;
+        }
+      }
+
+      // entropy coded data runs up to the next marker that isn't a restart
+      pos += 1 + length;
+      while (pos + 1 < data.size() &&
+             (data[pos] != 0xFF || data[pos + 1] == 0 ||
+              (data[pos + 1] >= 0xD0 && data[pos + 1] <= 0xD7)))
+        pos++;
+      continue;
+    }
+    pos += 1 + length;
+  }
+  return 0;
+}
+
+// Finds the TIFF data of the APP2 MPF segment among the segments before the
+// first scan, returning its offset or 0 when there is none
+size_t find_mpf(const std::vector<uint8_t> &data, size_t *size) {
+  static const uint8_t prefix[] = {'M', 'P', 'F', 0};
+  size_t pos = 2;
+  while (pos < data.size() && data[pos] == 0xFF) {
+    while (pos < data.size() && data[pos] == 0xFF)
+      pos++;
+    if (pos + 3 > data.size() || data[pos] == 0xDA || data[pos] == 0xD9)
+      return 0;
+
+    uint8_t marker = data[pos];
+    size_t length = (data[pos + 1] << 8) | data[pos + 2];
+    if (length < 2 || pos + 1 + length > data.size())
+      return 0;
+    if (marker == JPEG_APP0 + 2 && length > 2 + sizeof(prefix) &&
+        memcmp(data.data() + pos + 3, prefix, sizeof(prefix)) == 0) {
+      *size = length - 2 - sizeof(prefix);
+      return pos + 3 + sizeof(prefix);
+    }
+    pos += 1 + length;
+  }
+  return 0;
+}
+} // namespace
+
 JpegDecoder::JpegDecoder(std::vector<uint8_t> *data, bool subsampling_pad,
                          bool rgb, bool fancy_upsampling,
                          cmsHPROFILE cmyk_profile,
-                         cmsHPROFILE cmyk_target_profile)
-    : BaseDecoder(data), d(std::make_unique<JpegDecodeSession>(data)),
-      subsampling_pad(subsampling_pad), rgb(rgb),
-      fancy_upsampling(fancy_upsampling), cmyk_profile(cmyk_profile),
-      cmyk_target_profile(cmyk_target_profile) {
+                         cmsHPROFILE cmyk_target_profile, uint32_t band_top,
+                         uint32_t band_height, uint32_t threads, bool pipeline,
+                         uint32_t index_spacing, const std::string &index_path,
+                         std::shared_ptr<const JpegIndex> shared_index,
+                         uint32_t output_bits, J_DCT_METHOD dct_method,
+                         uint32_t preview_scans, bool preview_dc,
+                         size_t max_memory, bool luma_only)
+    : BaseDecoder(data),
+      d(std::make_unique<JpegDecodeSession>(data, max_memory)),
+      source(data), preview_dc(preview_dc), subsampling_pad(subsampling_pad),
+      rgb(rgb),
+      fancy_upsampling(fancy_upsampling && dct_method != JDCT_IFAST),
+      dct_method(dct_method), cmyk_profile(cmyk_profile),
+      cmyk_target_profile(cmyk_target_profile), band_top(band_top),
+      threads(std::max<uint32_t>(threads, 1)), pipeline(pipeline),
+      max_memory(max_memory), luma_only(luma_only) {
+  // libjpeg takes the file cut after the preview's scans as a progressive
+  // JPEG whose later scans are missing, smoothing blocks that lack their AC
+  // coefficients
+  if (d->jinfo.progressive_mode && (preview_scans > 0 || preview_dc)) {
+    size_t end = preview_end(*data, preview_scans, preview_dc);
+    if (end > 0) {
+      preview.assign(data->begin(), data->begin() + end);
+      preview.push_back(0xFF);
+      preview.push_back(JPEG_EOI);
+      source = &preview;
+      d = std::make_unique<JpegDecodeSession>(source, max_memory);
+    }
+  }
+
   auto jcs = d->jinfo.jpeg_color_space;
-  auto color = jcs == JCS_RGB            ? VSColorFamily::cfRGB
+  if (luma_only && (jcs == JCS_CMYK || jcs == JCS_YCCK)) {
+    throw std::runtime_error("luma_only: CMYK JPEGs are not supported");
+  }
+  auto color = luma_only                 ? VSColorFamily::cfGray
+               : jcs == JCS_RGB          ? VSColorFamily::cfRGB
                : jcs == JCS_YCbCr && rgb ? VSColorFamily::cfRGB
                : jcs == JCS_YCbCr        ? VSColorFamily::cfYUV
                : jcs == JCS_GRAYSCALE    ? VSColorFamily::cfGray
@@ -72,18 +278,51 @@ JpegDecoder::JpegDecoder(std::vector<uint8_t> *data, bool subsampling_pad,
                : jcs == JCS_YCCK         ? VSColorFamily::cfRGB
                                          : VSColorFamily::cfUndefined;
 
+  // the plugin's own IDCT, upsampling and DC preview take 8 bit DCT JPEGs,
+  // libjpeg-turbo 3 decodes 12 bit and lossless ones on its own. Lossless
+  // scans start with a predictor where DCT ones start at coefficient 0.
+  bool lossless = !d->jinfo.progressive_mode && d->jinfo.Ss != 0;
+  bool dct8 = d->jinfo.data_precision == 8 && !lossless;
+  if (preview_dc && !dct8) {
+    throw std::runtime_error("jpeg_preview_dc: Only 8 bit DCT JPEGs are "
+                             "supported");
+  }
+
   uint32_t subsampling_w = 0;
   uint32_t subsampling_h = 0;
 
   uint32_t actual_width = static_cast<uint32_t>(d->jinfo.image_width);
   uint32_t actual_height = static_cast<uint32_t>(d->jinfo.image_height);
+  if (preview_dc) {
+    actual_width = (actual_width + DCTSIZE - 1) / DCTSIZE;
+    actual_height = (actual_height + DCTSIZE - 1) / DCTSIZE;
+  }
 
   uint32_t width = actual_width;
   uint32_t height = actual_height;
 
   if (color == VSColorFamily::cfYUV) {
-    subsampling_w = d->jinfo.comp_info[0].h_samp_factor >> 1;
-    subsampling_h = d->jinfo.comp_info[0].v_samp_factor >> 1;
+    // a subsampled format needs full resolution luma and both chroma
+    // components sampled alike at a power of two ratio, anything else is
+    // upsampled to 4:4:4, as are lossless JPEGs, which libjpeg has no raw
+    // output for
+    auto *comp = d->jinfo.comp_info;
+    int max_h = d->jinfo.max_h_samp_factor;
+    int max_v = d->jinfo.max_v_samp_factor;
+    auto log2 = [](int ratio) {
+      return ratio == 1 ? 0 : ratio == 2 ? 1 : ratio == 4 ? 2 : -1;
+    };
+    int ss_w = log2(max_h / comp[1].h_samp_factor);
+    int ss_h = log2(max_v / comp[1].v_samp_factor);
+    if (!lossless && comp[0].h_samp_factor == max_h &&
+        comp[0].v_samp_factor == max_v &&
+        comp[1].h_samp_factor == comp[2].h_samp_factor &&
+        comp[1].v_samp_factor == comp[2].v_samp_factor &&
+        max_h % comp[1].h_samp_factor == 0 &&
+        max_v % comp[1].v_samp_factor == 0 && ss_w >= 0 && ss_h >= 0) {
+      subsampling_w = ss_w;
+      subsampling_h = ss_h;
+    }
 
     if (subsampling_w > 0) {
       uint8_t subsamp_size = 1 << subsampling_w;
@@ -104,14 +343,68 @@ JpegDecoder::JpegDecoder(std::vector<uint8_t> *data, bool subsampling_pad,
 
   // TODO?: cmyk using alpha
 
+  bool planar = color == VSColorFamily::cfYUV &&
+                (subsampling_w != 0 || subsampling_h != 0);
+  // component 0 of YCbCr is the luma as it is, libjpeg computes it from RGB
+  direct = dct8 && (planar ||
+                    (jcs == JCS_YCbCr && color != VSColorFamily::cfRGB) ||
+                    jcs == JCS_GRAYSCALE ||
+                    (!luma_only && (jcs == JCS_RGB || jcs == JCS_CMYK)));
+  if (!planar) {
+    for (int i = 0; i < (luma_only ? 1 : d->jinfo.num_components); i++) {
+      if (d->jinfo.comp_info[i].h_samp_factor != d->jinfo.max_h_samp_factor ||
+          d->jinfo.comp_info[i].v_samp_factor != d->jinfo.max_v_samp_factor)
+        direct = false;
+    }
+  }
+  convert = dct8 && !direct && !luma_only &&
+            (jcs == JCS_YCbCr || jcs == JCS_RGB);
+
   uint32_t components;
   uint32_t bits;
   if (jcs == JCS_CMYK || jcs == JCS_YCCK) {
     components = 3;
     bits = 16;
   } else {
-    components = static_cast<uint32_t>(d->jinfo.num_components);
-    bits = 8;
+    components =
+        luma_only ? 1 : static_cast<uint32_t>(d->jinfo.num_components);
+    // more than 8 bits of precision don't fit 8 bit output
+    bits = d->jinfo.data_precision > 8 && output_bits == 8 ? 16 : output_bits;
+  }
+
+  full_height = height;
+
+  if (band_top > 0 || band_height > 0) {
+    if (band_height == 0) {
+      band_height = height > band_top ? height - band_top : 0;
+    }
+    if (band_height == 0 || (uint64_t)band_top + band_height > height) {
+      throw std::runtime_error("band: Outside of the image");
+    }
+    uint32_t subsamp_size = 1 << subsampling_h;
+    if (band_top % subsamp_size != 0 || band_height % subsamp_size != 0) {
+      throw std::runtime_error("band: Not aligned to chroma subsampling");
+    }
+    height = band_height;
+    actual_height = std::min(band_height, actual_height - band_top);
+  }
+
+  // the index splits the file at full size, which a DC preview isn't
+  if (preview_dc) {
+    // decoded whole through the pipeline
+  } else if (shared_index) {
+    // built for the same data by an earlier decoder
+    index = std::move(shared_index);
+  } else if (index_spacing > 0 || !index_path.empty()) {
+    index = std::make_unique<JpegIndex>(
+        *data, index_spacing > 0 ? index_spacing : 4, index_path);
+  } else if (this->threads > 1 && !pipeline) {
+    // threads alone fall back to a serial decode for JPEGs the index can't
+    // handle, such as progressive ones
+    try {
+      index = std::make_unique<JpegIndex>(*data, 4, "");
+    } catch (const std::runtime_error &) {
+    }
   }
 
   info = {
@@ -120,171 +413,865 @@ JpegDecoder::JpegDecoder(std::vector<uint8_t> *data, bool subsampling_pad,
       .actual_width = actual_width,
       .actual_height = actual_height,
       .components = components,
+      .planar = planar || convert,
       .color = color,
-      .sample_type = VSSampleType::stInteger,
+      .sample_type =
+          bits == 32 ? VSSampleType::stFloat : VSSampleType::stInteger,
       .bits = bits,
       .subsampling_w = subsampling_w,
       .subsampling_h = subsampling_h,
       .yuv_matrix = 5,
   };
+
+  size_t exif_size;
+  if (const uint8_t *exif = d->exif(&exif_size))
+    info.orientation = parse_exif(exif, exif_size).orientation;
 }
 
-std::vector<uint8_t> JpegDecoder::decode() {
-  if (d->finished_reading)
-    d = std::make_unique<JpegDecodeSession>(m_data);
+std::vector<uint8_t>
+JpegDecoder::exif_thumbnail(std::vector<uint8_t> *data,
+                            uint32_t *orientation) {
+  JpegDecodeSession s(data, 0);
+  size_t size;
+  const uint8_t *tiff = s.exif(&size);
+  if (!tiff)
+    return {};
+  ExifInfo exif = parse_exif(tiff, size);
+  *orientation = exif.orientation;
+  return std::vector<uint8_t>(tiff + exif.thumbnail_offset,
+                              tiff + exif.thumbnail_offset +
+                                  exif.thumbnail_length);
+}
 
-  auto *dinfo = &d->jinfo;
-  auto jcs = dinfo->jpeg_color_space;
+std::vector<MpfImage>
+JpegDecoder::mpf_images(const std::vector<uint8_t> &data) {
+  size_t size;
+  size_t tiff = find_mpf(data, &size);
+  if (tiff == 0)
+    return {};
+
+  std::vector<MpfImage> images;
+  for (MpfImage image : parse_mpf(data.data() + tiff, size)) {
+    uint64_t offset = image.offset == 0 ? 0 : tiff + (uint64_t)image.offset;
+    if (image.size < 3 || offset > UINT32_MAX || offset > data.size() ||
+        image.size > data.size() - offset ||
+        !is_jpeg(data.data() + offset))
+      continue;
+    image.offset = (uint32_t)offset;
+    images.push_back(image);
+  }
+  return images;
+}
 
-  std::vector<uint8_t> pixels(info.height * info.width * info.components *
-                              (info.bits >> 3));
-  std::fill(pixels.begin(), pixels.end(), 0);
-  uint8_t *ppixels = pixels.data();
+size_t JpegDecoder::header_size(const std::vector<uint8_t> &data) {
+  size_t pos = 2;
+  while (pos < data.size() && data[pos] == 0xFF) {
+    while (pos < data.size() && data[pos] == 0xFF)
+      pos++;
+    if (pos + 3 > data.size())
+      return 0;
+
+    uint8_t marker = data[pos];
+    size_t length = (data[pos + 1] << 8) | data[pos + 2];
+    // markers without a length don't come before the first scan
+    if (length < 2 || (marker >= 0xD0 && marker <= 0xD9) || marker == 0x01)
+      return 0;
+    pos += 1 + length;
+    if (marker == 0xDA)
+      return pos <= data.size() ? pos : 0;
+  }
+  return 0;
+}
+
+uint32_t JpegDecoder::padded_height(uint32_t height) {
+  uint32_t subsamp_size = 1 << info.subsampling_h;
+  if (height % subsamp_size != 0)
+    height = height + subsamp_size - (height % subsamp_size);
+  return height;
+}
+
+void JpegDecoder::prepare_cmyk() {
+  if (!cmyk_profile) {
+    cmyk_profile = d->get_color_profile();
+  }
+
+  if (!cmyk_profile) {
+    cmyk_profile = cmsOpenProfileFromMem(CMYK_USWebCoatedSWOP_icc,
+                                         CMYK_USWebCoatedSWOP_icc_len);
+  }
 
-  std::vector<uint8_t> pixels2;
+  if (!cmyk_profile) {
+    throw std::runtime_error("Failed to load CMYK profile");
+  }
+
+  if (!cmyk_target_profile) {
+    cmyk_target_profile = cmsCreate_sRGBProfile();
+  }
+}
+
+PooledVector<uint8_t> JpegDecoder::decode() {
+  auto jcs = d->jinfo.jpeg_color_space;
   if (jcs == JCS_CMYK || jcs == JCS_YCCK) {
-    if (!cmyk_profile) {
-      cmyk_profile = d->get_color_profile();
+    prepare_cmyk();
+  }
+
+  if (index) {
+    return decode_indexed();
+  }
+
+  if (d->finished_reading)
+    d = std::make_unique<JpegDecodeSession>(source, max_memory);
+
+  // under a memory limit the pipeline runs the IDCT on this thread
+  uint32_t workers = pipeline && max_memory == 0 ? threads : 0;
+
+  if (info.height == full_height) {
+    PooledVector<uint8_t> pixels = decode_session(*d, info.height, workers);
+    d->finished_reading = true;
+    return pixels;
+  }
+
+  PooledVector<uint8_t> image = decode_session(*d, full_height, workers);
+  d->finished_reading = true;
+
+  PooledVector<uint8_t> pixels(output_size(info.height));
+  copy_rows(image.data(), full_height, band_top, pixels.data(), info.height, 0,
+            info.height);
+  return pixels;
+}
+
+// Bytes of the output of decode_session for a number of rows, with the
+// chroma planes of subsampled YUV at their own size
+size_t JpegDecoder::output_size(uint32_t height) {
+  size_t bytes = info.bits >> 3;
+  if (info.planar) {
+    size_t chroma = (size_t)(info.width >> info.subsampling_w) *
+                    (height >> info.subsampling_h);
+    return ((size_t)info.width * height + chroma * 2) * bytes;
+  }
+  return (size_t)info.width * height * info.components * bytes;
+}
+
+// Copies rows between buffers in the layout decode_session produces, which
+// is planar for subsampled YUV and converted RGB and interleaved otherwise
+void JpegDecoder::copy_rows(const uint8_t *src, uint32_t src_height,
+                            uint32_t src_row, uint8_t *dst,
+                            uint32_t dst_height, uint32_t dst_row,
+                            uint32_t rows) {
+  if (info.planar) {
+    size_t bytes = info.bits >> 3;
+    size_t w = info.width * bytes;
+    size_t pw = (info.width >> info.subsampling_w) * bytes;
+    uint32_t sh = info.subsampling_h;
+
+    memcpy(dst + w * dst_row, src + w * src_row, w * rows);
+    for (int p = 0; p < 2; p++) {
+      memcpy(dst + w * dst_height + pw * (dst_height >> sh) * p +
+                 pw * (dst_row >> sh),
+             src + w * src_height + pw * (src_height >> sh) * p +
+                 pw * (src_row >> sh),
+             pw * (rows >> sh));
     }
+  } else {
+    size_t stride = (size_t)info.width * info.components * (info.bits >> 3);
+    memcpy(dst + stride * dst_row, src + stride * src_row, stride * rows);
+  }
+}
 
-    if (!cmyk_profile) {
-      cmyk_profile = cmsOpenProfileFromMem(CMYK_USWebCoatedSWOP_icc,
-                                           CMYK_USWebCoatedSWOP_icc_len);
+// Splits the MCU rows covering the output into a range per thread, each
+// decoded on the pool from a JPEG extracted through the index
+PooledVector<uint8_t> JpegDecoder::decode_indexed() {
+  PooledVector<uint8_t> pixels(output_size(info.height));
+
+  uint32_t mcu_height = index->mcu_height();
+  uint32_t first = band_top / mcu_height;
+  uint32_t last = std::min(
+      (band_top + info.height + mcu_height - 1) / mcu_height,
+      index->mcu_rows());
+
+  // fancy upsampling of vertically subsampled chroma, by the plugin or by
+  // libjpeg, looks at the chroma rows around each one, so ranges are
+  // extracted with an extra MCU row of context
+  uint32_t margin = !direct && fancy_upsampling && mcu_height > DCTSIZE ? 1 : 0;
+
+  parallel_for(pool, first, last, threads, [&](uint32_t start, uint32_t end) {
+    uint32_t from = start > margin ? start - margin : 0;
+    uint32_t to = std::min(end + margin, index->mcu_rows());
+
+    std::vector<uint8_t> jpeg = index->extract(*m_data, from, to - from);
+    JpegDecodeSession s(&jpeg, max_memory);
+    uint32_t height = padded_height(s.jinfo.image_height);
+    PooledVector<uint8_t> part = decode_session(s, height, 0);
+
+    uint32_t top = std::max(start * mcu_height, band_top);
+    uint32_t bottom =
+        std::min(std::min(end * mcu_height, from * mcu_height + height),
+                 band_top + info.height);
+    copy_rows(part.data(), height, top - from * mcu_height, pixels.data(),
+              info.height, top - band_top, bottom - top);
+  });
+
+  return pixels;
+}
+
+// Reads coefficients on the calling thread and hands finished iMCU rows to
+// workers on the pool, which run the IDCT and write the samples, and joins
+// them once every row is read. Single scan
+// JPEGs are fed to libjpeg in chunks through a suspending source so rows
+// reach the workers while the rest of the file is still being decoded.
+// 8 bit output uses libjpeg's accurate integer IDCT, or the float IDCT
+// rounded to 8 bits for JDCT_FLOAT. JDCT_IFAST keeps the accurate one,
+// which is about as fast here. 16 bit and float output come straight from
+// the float IDCT without rounding to 8 bits in between, clamped to the
+// sample range like the integer IDCT output. Under a memory limit the
+// coefficients may be in a file with only a window of rows in memory, so
+// the rows are transformed one at a time on the calling thread once the
+// whole file has been read.
+void JpegDecoder::decode_pipelined(JpegDecodeSession &s, uint8_t *out,
+                                   const std::vector<Plane> &planes,
+                                   uint32_t bits, uint32_t workers) {
+  auto *dinfo = &s.jinfo;
+  int nc = dinfo->num_components;
+
+  // map the float IDCT output to full range samples with chroma centered
+  // like zimg expects
+  float scale[MAX_COMPONENTS];
+  float offset[MAX_COMPONENTS];
+  for (int c = 0; c < nc; c++) {
+    bool chroma = dinfo->jpeg_color_space == JCS_YCbCr && c > 0;
+    scale[c] = bits == 32 ? 1.f / 255 : 257;
+    offset[c] = !chroma ? 0 : bits == 32 ? -128.f / 255 : 32768 - 128 * 257;
+  }
+
+  JpegCoefficients &coefficients = *s.coefficients;
+  bool limited = coefficients.limited();
+
+  uint32_t total = dinfo->total_iMCU_rows;
+  std::vector<JBLOCKARRAY> rows((size_t)total * nc);
+  const UINT16 *quant[MAX_COMPONENTS] = {};
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  uint32_t ready = 0;
+  uint32_t next = 0;
+  bool done = false;
+  std::exception_ptr error;
+
+  // a DC preview has one sample per block
+  uint32_t size = preview_dc ? 1 : DCTSIZE;
+
+  // components without a plane, the chroma of luma only output, are skipped
+  auto process = [&](uint32_t row) {
+    uint8_t block[DCTSIZE2];
+    float fblock[DCTSIZE2];
+    for (int c = 0; c < (int)planes.size(); c++) {
+      jpeg_component_info *compptr = &dinfo->comp_info[c];
+      const Plane &p = planes[c];
+      JBLOCKARRAY blocks = rows[(size_t)row * nc + c];
+
+      for (int by = 0; by < compptr->v_samp_factor; by++) {
+        uint32_t y0 = (row * compptr->v_samp_factor + by) * size;
+        if (y0 >= p.height)
+          break;
+        uint32_t bh = std::min<uint32_t>(DCTSIZE, p.height - y0);
+
+        for (uint32_t bx = 0; bx < compptr->width_in_blocks; bx++) {
+          uint32_t x0 = bx * size;
+          if (x0 >= p.width)
+            break;
+          uint32_t bw = std::min<uint32_t>(DCTSIZE, p.width - x0);
+
+          uint8_t *base = out + p.offset;
+          size_t at = y0 * p.stride + x0 * p.step;
+          if (preview_dc) {
+            // libjpeg's 1x1 IDCT, the rounded mean of the block
+            int dc = blocks[by][bx][0] * quant[c][0];
+            if (bits == 8) {
+              int v = ((dc + 4) >> 3) + 128;
+              base[at] = (uint8_t)std::min(std::max(v, 0), 255);
+            } else {
+              float v = std::min(std::max(dc / 8.f + 128, 0.f), 255.f);
+              v = v * scale[c] + offset[c];
+              if (bits == 16) {
+                reinterpret_cast<uint16_t *>(base)[at] =
+                    (uint16_t)(std::max(v, 0.f) + 0.5f);
+              } else {
+                reinterpret_cast<float *>(base)[at] = v;
+              }
+            }
+          } else if (bits == 8) {
+            if (dct_method == JDCT_FLOAT) {
+              jpeg_idct_float_8(blocks[by][bx], quant[c], fblock);
+              for (int i = 0; i < DCTSIZE2; i++) {
+                block[i] = (uint8_t)std::min(std::max(fblock[i] + 0.5f, 0.f),
+                                             255.f);
+              }
+            } else {
+              jpeg_idct_islow_8(blocks[by][bx], quant[c], block, DCTSIZE);
+            }
+            for (uint32_t y = 0; y < bh; y++) {
+              uint8_t *dst = base + at + y * p.stride;
+              for (uint32_t x = 0; x < bw; x++)
+                dst[x * p.step] = block[y * DCTSIZE + x];
+            }
+          } else if (bits == 16) {
+            jpeg_idct_float_8(blocks[by][bx], quant[c], fblock);
+            for (uint32_t y = 0; y < bh; y++) {
+              uint16_t *dst =
+                  reinterpret_cast<uint16_t *>(base) + at + y * p.stride;
+              for (uint32_t x = 0; x < bw; x++) {
+                float v = std::min(std::max(fblock[y * DCTSIZE + x], 0.f),
+                                   255.f);
+                v = std::max(v * scale[c] + offset[c], 0.f);
+                dst[x * p.step] = (uint16_t)(v + 0.5f);
+              }
+            }
+          } else {
+            jpeg_idct_float_8(blocks[by][bx], quant[c], fblock);
+            for (uint32_t y = 0; y < bh; y++) {
+              float *dst =
+                  reinterpret_cast<float *>(base) + at + y * p.stride;
+              for (uint32_t x = 0; x < bw; x++) {
+                float v = std::min(std::max(fblock[y * DCTSIZE + x], 0.f),
+                                   255.f);
+                dst[x * p.step] = v * scale[c] + offset[c];
+              }
+            }
+          }
+        }
+      }
     }
+  };
 
-    if (!cmyk_profile) {
-      throw std::runtime_error("Failed to load CMYK profile");
+  auto work = [&]() {
+    while (true) {
+      uint32_t row;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return next < ready || done; });
+        if (next >= ready)
+          return;
+        row = next++;
+      }
+
+      try {
+        process(row);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error)
+          error = std::current_exception();
+      }
     }
+  };
 
-    if (!cmyk_target_profile) {
-      cmyk_target_profile = cmsCreate_sRGBProfile();
+  auto fetch = [&](uint32_t row) {
+    for (int c = 0; c < nc; c++) {
+      jpeg_component_info *compptr = &dinfo->comp_info[c];
+      // set once, before the first rows are published, as the workers
+      // read it without the lock
+      if (!quant[c]) {
+        if (!compptr->quant_table)
+          throw std::runtime_error(
+              "JPEG component without quantization table");
+        quant[c] = compptr->quant_table->quantval;
+      }
+      rows[(size_t)row * nc + c] = (*dinfo->mem->access_virt_barray)(
+          (j_common_ptr)dinfo, coefficients.arrays[c],
+          row * compptr->v_samp_factor, compptr->v_samp_factor, FALSE);
     }
+  };
 
-    pixels2.resize(info.height * info.width * 4);
-    ppixels = pixels2.data();
-  }
+  // makes rows up to end visible to the workers
+  auto publish = [&](uint32_t end) {
+    if (end <= ready)
+      return;
+    for (uint32_t row = ready; row < end; row++)
+      fetch(row);
 
-  dinfo->out_color_space = jcs == JCS_YCCK                       ? JCS_CMYK
-                           : jcs == JCS_CMYK                     ? JCS_CMYK
-                           : info.color == VSColorFamily::cfYUV  ? JCS_YCbCr
-                           : info.color == VSColorFamily::cfGray ? JCS_GRAYSCALE
-                                                                 : JCS_RGB;
+    std::lock_guard<std::mutex> lock(mutex);
+    ready = end;
+    cv.notify_all();
+  };
 
-  dinfo->do_fancy_upsampling = fancy_upsampling;
-  dinfo->dct_method = JDCT_ISLOW;
+  TaskGroup group(pool);
+  for (uint32_t t = 0; t < (limited ? 0 : workers); t++) {
+    group.run(work);
+  }
 
-  if (info.subsampling_w == 0 && info.subsampling_h == 0) {
-    uint32_t stride = info.width * dinfo->num_components;
-    jpeg_start_decompress(dinfo);
-    for (uint32_t y = 0; y < dinfo->output_height; y++) {
-      uint8_t *row_ptr = ppixels + stride * y;
-      jpeg_read_scanlines(dinfo, &row_ptr, 1);
+  auto *src = dinfo->src;
+  auto fill_input_buffer = src->fill_input_buffer;
+  const JOCTET *end = src->next_input_byte + src->bytes_in_buffer;
+  constexpr size_t chunk = 64 * 1024;
+
+  try {
+    bool stream = !jpeg_has_multiple_scans(dinfo) && !limited;
+    if (stream) {
+      src->bytes_in_buffer = std::min(src->bytes_in_buffer, chunk);
+      src->fill_input_buffer = [](j_decompress_ptr) -> boolean {
+        return FALSE;
+      };
     }
-    jpeg_finish_decompress(dinfo);
-  } else if (info.color == VSColorFamily::cfYUV) {
-    dinfo->raw_data_out = true;
 
-    jpeg_start_decompress(dinfo);
+    while (!jpeg_read_coefficients(dinfo)) {
+      if (!stream)
+        throw std::runtime_error("JPEG suspended");
+      if (coefficients.arrays.size() == (size_t)nc)
+        publish(dinfo->input_iMCU_row);
 
-    int ih[3];
-    int iw[3];
+      size_t left = end - src->next_input_byte;
+      if (src->bytes_in_buffer == left)
+        src->fill_input_buffer = fill_input_buffer;
+      src->bytes_in_buffer = std::min(left, src->bytes_in_buffer + chunk);
+    }
 
-    for (int i = 0; i < dinfo->num_components; i++) {
-      jpeg_component_info *compptr = &dinfo->comp_info[i];
-      ih[i] = info.height * compptr->v_samp_factor / dinfo->max_v_samp_factor;
-      iw[i] = info.width * compptr->h_samp_factor / dinfo->max_h_samp_factor;
+    if (coefficients.arrays.size() != (size_t)nc)
+      throw std::runtime_error("Missing JPEG coefficients");
+    if (limited) {
+      for (uint32_t row = 0; row < total; row++) {
+        fetch(row);
+        process(row);
+      }
+    } else {
+      publish(total);
     }
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error)
+      error = std::current_exception();
+  }
 
-    const int rows = dinfo->max_v_samp_factor * DCTSIZE;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+    cv.notify_all();
+  }
+  // the rows the workers haven't taken yet are transformed here too
+  work();
+  group.wait();
 
-    JSAMPARRAY yuv[3];
+  src->fill_input_buffer = fill_input_buffer;
 
-    JSAMPROW rowptrs[2 * DCTSIZE + DCTSIZE + DCTSIZE];
-    yuv[0] = &rowptrs[0];
-    yuv[1] = &rowptrs[2 * DCTSIZE];
-    yuv[2] = &rowptrs[3 * DCTSIZE];
+  if (error)
+    std::rethrow_exception(error);
+}
 
-    // Initialize rowptrs.
-    int numYRowsPerBlock = DCTSIZE * dinfo->comp_info[0].v_samp_factor;
-    for (int i = 0; i < numYRowsPerBlock; i++) {
-      rowptrs[0 * DCTSIZE + i] = ppixels + iw[0] * i;
-    }
+// Lays the components out one after another at their own resolution,
+// rounded up like libjpeg's downsampled sizes
+std::vector<JpegDecoder::Plane>
+JpegDecoder::component_planes(JpegDecodeSession &s, uint32_t height,
+                              size_t bytes) {
+  auto *dinfo = &s.jinfo;
+  std::vector<Plane> planes(dinfo->num_components);
+  size_t offset = 0;
+  for (int c = 0; c < dinfo->num_components; c++) {
+    jpeg_component_info *compptr = &dinfo->comp_info[c];
+    uint32_t w = (uint32_t)(((uint64_t)info.width * compptr->h_samp_factor +
+                             dinfo->max_h_samp_factor - 1) /
+                            dinfo->max_h_samp_factor);
+    uint32_t h = (uint32_t)(((uint64_t)height * compptr->v_samp_factor +
+                             dinfo->max_v_samp_factor - 1) /
+                            dinfo->max_v_samp_factor);
+    planes[c] = {offset, w, 1, w, h};
+    offset += (size_t)w * h * bytes;
+  }
+  return planes;
+}
+
+// Reads the samples of each component through libjpeg's raw data output,
+// as they are for 8 bit JPEGs with 8 bit output, and scaled to 16 bit or
+// float output for 12 bit ones
+void JpegDecoder::decode_raw(JpegDecodeSession &s, uint8_t *out,
+                             const std::vector<Plane> &planes) {
+  auto *dinfo = &s.jinfo;
+  int nc = dinfo->num_components;
+  bool wide = dinfo->data_precision != 8;
+  size_t sample_size = wide ? sizeof(uint16_t) : 1;
+  size_t bytes = info.bits >> 3;
+  dinfo->raw_data_out = true;
 
-    for (int i = 0; i < DCTSIZE; i++) {
-      rowptrs[2 * DCTSIZE + i] = ppixels + iw[0] * ih[0] + iw[1] * i;
-      rowptrs[3 * DCTSIZE + i] = rowptrs[2 * DCTSIZE + i] + iw[1] * ih[1];
+  jpeg_start_decompress(dinfo);
+
+  float scale[MAX_COMPONENTS];
+  float offset[MAX_COMPONENTS];
+  if (wide)
+    precision_scale(dinfo, info.bits, scale, offset);
+
+  // libjpeg writes whole blocks, so each row group is decoded into scratch
+  // rows padded to the block width and copied out to the planes
+  JSAMPARRAY raw[MAX_COMPONENTS];
+  JSAMPROW rowptrs[MAX_COMPONENTS][MAX_SAMP_FACTOR * DCTSIZE];
+#if LIBJPEG_TURBO_VERSION_NUMBER >= 3000000
+  J12SAMPARRAY raw12[MAX_COMPONENTS];
+  J12SAMPROW rowptrs12[MAX_COMPONENTS][MAX_SAMP_FACTOR * DCTSIZE];
+#endif
+  int group_rows[MAX_COMPONENTS];
+  PooledVector<uint8_t> scratch[MAX_COMPONENTS];
+  for (int c = 0; c < nc; c++) {
+    jpeg_component_info *compptr = &dinfo->comp_info[c];
+    size_t stride = compptr->width_in_blocks * DCTSIZE * sample_size;
+    group_rows[c] = compptr->v_samp_factor * DCTSIZE;
+    scratch[c].resize(stride * group_rows[c]);
+    for (int i = 0; i < group_rows[c]; i++) {
+      rowptrs[c][i] = scratch[c].data() + stride * i;
+#if LIBJPEG_TURBO_VERSION_NUMBER >= 3000000
+      rowptrs12[c][i] = reinterpret_cast<J12SAMPROW>(rowptrs[c][i]);
+#endif
     }
+    raw[c] = rowptrs[c];
+#if LIBJPEG_TURBO_VERSION_NUMBER >= 3000000
+    raw12[c] = rowptrs12[c];
+#endif
+  }
 
-    uint32_t numRowsPerBlock = numYRowsPerBlock;
-    // After each loop iteration, we will increment pointers to Y, U, and V.
-    size_t blockIncrementY = numRowsPerBlock * info.width;
-    size_t blockIncrementU = DCTSIZE * iw[1];
-    size_t blockIncrementV = DCTSIZE * iw[1];
+  uint32_t numRowsPerBlock = dinfo->max_v_samp_factor * DCTSIZE;
+  for (int y = 0; dinfo->output_scanline < dinfo->output_height; y++) {
+    JDIMENSION linesRead;
+    if (!wide) {
+      linesRead = jpeg_read_raw_data(dinfo, raw, numRowsPerBlock);
+    } else {
+#if LIBJPEG_TURBO_VERSION_NUMBER >= 3000000
+      linesRead = jpeg12_read_raw_data(dinfo, raw12, numRowsPerBlock);
+#else
+      throw std::runtime_error("JPEGs of more than 8 bits need "
+                               "libjpeg-turbo 3");
+#endif
+    }
+    if (linesRead == 0) {
+      throw std::runtime_error("huh?");
+    }
 
-    const int numIters = dinfo->output_height / numRowsPerBlock;
-    for (int i = 0; i < numIters; i++) {
-      JDIMENSION linesRead = jpeg_read_raw_data(dinfo, yuv, numRowsPerBlock);
-      if (linesRead < numRowsPerBlock) {
-        throw std::runtime_error("huh?");
+    for (int c = 0; c < nc; c++) {
+      const Plane &p = planes[c];
+      int top = y * group_rows[c];
+      int count = std::min<int>(group_rows[c], (int)p.height - top);
+      for (int i = 0; i < count; i++) {
+        uint8_t *dst = out + p.offset + p.stride * (top + i) * bytes;
+        if (!wide) {
+          memcpy(dst, rowptrs[c][i], p.width);
+        } else {
+          store_scaled(reinterpret_cast<const uint16_t *>(rowptrs[c][i]),
+                       dst, p.width, 1, info.bits, &scale[c], &offset[c]);
+        }
       }
+    }
+  }
+  // jpeg_finish_decompress(dinfo);
+}
 
-      // Update rowptrs.
-      for (int i = 0; i < numYRowsPerBlock; i++) {
-        rowptrs[i] += blockIncrementY;
-      }
-      for (int i = 0; i < DCTSIZE; i++) {
-        rowptrs[i + 2 * DCTSIZE] += blockIncrementU;
-        rowptrs[i + 3 * DCTSIZE] += blockIncrementV;
-      }
+// Decodes each component at its own resolution, then upsamples them and
+// converts YCbCr to RGB for RGB output, writing planes in bands of rows
+// split between workers on the pool. 16 bit and float output are upsampled and
+// converted from float samples.
+void JpegDecoder::decode_converted(JpegDecodeSession &s, uint8_t *out,
+                                   uint32_t height, uint32_t bits,
+                                   uint32_t workers) {
+  auto *dinfo = &s.jinfo;
+  size_t bytes = bits == 8 ? 1 : sizeof(float);
+
+  std::vector<Plane> planes = component_planes(s, height, bytes);
+  const Plane &last = planes.back();
+  PooledVector<uint8_t> samples(last.offset +
+                                last.stride * last.height * bytes);
+
+  if (bits == 8 && workers == 0 && !preview_dc) {
+    decode_raw(s, samples.data(), planes);
+  } else {
+    decode_pipelined(s, samples.data(), planes, bits == 8 ? 8 : 32,
+                     std::max<uint32_t>(workers, 1));
+  }
+
+  uint32_t h_expand[3];
+  uint32_t v_expand[3];
+  bool fancy[3];
+  for (int c = 0; c < 3; c++) {
+    jpeg_component_info *compptr = &dinfo->comp_info[c];
+    if (dinfo->max_h_samp_factor % compptr->h_samp_factor != 0 ||
+        dinfo->max_v_samp_factor % compptr->v_samp_factor != 0) {
+      throw std::runtime_error("Fractional chroma sampling is not supported");
     }
+    h_expand[c] = dinfo->max_h_samp_factor / compptr->h_samp_factor;
+    v_expand[c] = dinfo->max_v_samp_factor / compptr->v_samp_factor;
+    // libjpeg's choice of upsampler, with the factors its fancy ones handle
+    // and no fancy upsampling at 1/8 scale
+    fancy[c] = fancy_upsampling && !preview_dc && h_expand[c] <= 2 &&
+               v_expand[c] <= 2 &&
+               (h_expand[c] == 1 || planes[c].width > 2);
+  }
 
-    uint32_t remainingRows = dinfo->output_height - dinfo->output_scanline;
+  size_t plane_size = (size_t)info.width * height;
+  bool ycc_rgb = dinfo->jpeg_color_space == JCS_YCbCr &&
+                 info.color == VSColorFamily::cfRGB;
 
-    if (remainingRows > 0) {
-      int pwidth = dinfo->output_width;
-      if (pwidth % DCTSIZE != 0)
-        pwidth += (DCTSIZE - (dinfo->output_width % DCTSIZE));
+  auto convert_rows = [&](auto sample, uint32_t top, uint32_t bottom) {
+    using T = decltype(sample);
+    const T *base = reinterpret_cast<const T *>(samples.data());
 
-      std::vector<uint8_t> dummyRow(pwidth);
-      for (int i = remainingRows; i < numYRowsPerBlock; i++) {
-        rowptrs[i] = dummyRow.data();
-      }
-      int remainingUVRows =
-          dinfo->comp_info[1].downsampled_height - DCTSIZE * numIters;
-      for (int i = remainingUVRows; i < DCTSIZE; i++) {
-        rowptrs[i + 2 * DCTSIZE] = dummyRow.data();
-        rowptrs[i + 3 * DCTSIZE] = dummyRow.data();
+    PooledVector<T> rows[3];
+    // input row held in rows, nearest upsampling repeats it vertically
+    uint32_t held[3] = {UINT32_MAX, UINT32_MAX, UINT32_MAX};
+    for (int c = 0; c < 3; c++) {
+      rows[c].resize((size_t)planes[c].width * h_expand[c]);
+    }
+    PooledVector<int16_t> sums_8(bits == 8 ? info.width + 2 : 0);
+    PooledVector<float> sums(bits == 8 ? 0 : info.width + 2);
+    PooledVector<float> rgb(bits == 16 ? (size_t)info.width * 3 : 0);
+
+    for (uint32_t y = top; y < bottom; y++) {
+      const T *src[3];
+      for (int c = 0; c < 3; c++) {
+        const Plane &p = planes[c];
+        uint32_t row = y / v_expand[c];
+        const T *near = base + p.offset / sizeof(T) + p.stride * row;
+
+        if (h_expand[c] == 1 && v_expand[c] == 1) {
+          src[c] = near;
+          continue;
+        }
+        src[c] = rows[c].data();
+
+        if (!fancy[c]) {
+          if (held[c] != row)
+            jpeg_upsample_row(near, p.width, h_expand[c], rows[c].data());
+          held[c] = row;
+          continue;
+        }
+
+        // libjpeg repeats the edge rows of a component past its ends
+        bool lower = y % 2 == 1;
+        uint32_t far_row = v_expand[c] == 1 ? row
+                           : lower ? std::min(row + 1, p.height - 1)
+                           : row > 0 ? row - 1
+                                     : 0;
+        const T *far = base + p.offset / sizeof(T) + p.stride * far_row;
+        bool h2 = h_expand[c] == 2;
+        bool v2 = v_expand[c] == 2;
+        if constexpr (std::is_same_v<T, uint8_t>) {
+          jpeg_fancy_upsample_row_8(near, far, p.width, h2, v2, lower,
+                                    sums_8.data(), rows[c].data());
+        } else {
+          jpeg_fancy_upsample_row_float(near, far, p.width, h2, v2,
+                                        sums.data(), rows[c].data());
+        }
       }
 
-      JDIMENSION linesRead = jpeg_read_raw_data(dinfo, yuv, numRowsPerBlock);
-      if (linesRead < remainingRows) {
-        throw std::runtime_error("huh?");
+      size_t at = (size_t)info.width * y;
+      if (!ycc_rgb) {
+        // 16 bit samples come from float ones with chroma centered at 0
+        for (int p = 0; p < 3; p++) {
+          if constexpr (std::is_same_v<T, uint8_t>) {
+            memcpy(out + plane_size * p + at, src[p], info.width);
+          } else if (bits == 32) {
+            memcpy(reinterpret_cast<float *>(out) + plane_size * p + at,
+                   src[p], info.width * sizeof(float));
+          } else {
+            uint16_t *dst = reinterpret_cast<uint16_t *>(out);
+            float offset =
+                p > 0 && dinfo->jpeg_color_space == JCS_YCbCr ? 32768 : 0;
+            for (uint32_t x = 0; x < info.width; x++) {
+              float v = src[p][x] * 65535 + offset;
+              v = std::min(std::max(v, 0.f), 65535.f);
+              dst[plane_size * p + at + x] = (uint16_t)(v + 0.5f);
+            }
+          }
+        }
+      } else if constexpr (std::is_same_v<T, uint8_t>) {
+        jpeg_ycc_rgb_8(src[0], src[1], src[2], out + at, out + plane_size + at,
+                       out + plane_size * 2 + at, info.width);
+      } else if (bits == 32) {
+        float *dst = reinterpret_cast<float *>(out);
+        jpeg_ycc_rgb_float(src[0], src[1], src[2], dst + at,
+                           dst + plane_size + at, dst + plane_size * 2 + at,
+                           info.width);
+      } else {
+        jpeg_ycc_rgb_float(src[0], src[1], src[2], rgb.data(),
+                           rgb.data() + info.width,
+                           rgb.data() + info.width * 2, info.width);
+        uint16_t *dst = reinterpret_cast<uint16_t *>(out);
+        for (int p = 0; p < 3; p++) {
+          for (uint32_t x = 0; x < info.width; x++) {
+            float v = rgb[info.width * p + x] * 65535;
+            v = std::min(std::max(v, 0.f), 65535.f);
+            dst[plane_size * p + at + x] = (uint16_t)(v + 0.5f);
+          }
+        }
       }
     }
-    // jpeg_finish_decompress(dinfo);
-  } else {
-    throw std::runtime_error("huh?");
+  };
+
+  parallel_for(pool, 0, height, workers, [&](uint32_t top, uint32_t bottom) {
+    if (bits == 8) {
+      convert_rows(uint8_t(), top, bottom);
+    } else {
+      convert_rows(float(), top, bottom);
+    }
+  });
+}
+
+// Decodes through the pipeline with the given number of workers, or through
+// libjpeg when workers is 0 and the output is 8 bit
+PooledVector<uint8_t> JpegDecoder::decode_session(JpegDecodeSession &s,
+                                                  uint32_t height,
+                                                  uint32_t workers) {
+  auto *dinfo = &s.jinfo;
+  auto jcs = dinfo->jpeg_color_space;
+
+  // every path writes every sample, so the buffer isn't cleared first
+  PooledVector<uint8_t> pixels(output_size(height));
+
+  dinfo->out_color_space = jcs == JCS_YCCK                       ? JCS_CMYK
+                           : jcs == JCS_CMYK                     ? JCS_CMYK
+                           : info.color == VSColorFamily::cfYUV  ? JCS_YCbCr
+                           : info.color == VSColorFamily::cfGray ? JCS_GRAYSCALE
+                                                                 : JCS_RGB;
+
+  dinfo->do_fancy_upsampling = fancy_upsampling;
+  dinfo->do_block_smoothing = dct_method != JDCT_IFAST;
+  dinfo->dct_method = dct_method;
+  if (preview_dc) {
+    dinfo->scale_num = 1;
+    dinfo->scale_denom = DCTSIZE;
   }
 
-  if (jcs == JCS_CMYK || jcs == JCS_YCCK) {
+  bool cmyk = jcs == JCS_CMYK || jcs == JCS_YCCK;
+  bool wide = dinfo->data_precision != 8;
+  uint32_t bits = !cmyk ? info.bits : wide ? 16 : 8;
+  size_t bytes = bits >> 3;
+
+  // the pipeline only runs the IDCT, so it takes the outputs that libjpeg
+  // neither upsamples nor color converts, and the plugin's own upsampling
+  // and conversion for RGB output from YCbCr. DC previews of them always
+  // go through the pipeline, and libjpeg scales the rest
+  bool pipelined =
+      !convert && direct && (workers > 0 || bits != 8 || preview_dc);
+  bool scanlines = !convert && !pipelined && info.subsampling_w == 0 &&
+                   info.subsampling_h == 0;
+
+  // CMYK scanlines are transformed to RGB in stripes of rows, so only the
+  // other paths hold the CMYK samples of the whole image
+  std::unique_ptr<void, decltype(&cmsDeleteTransform)> transform(
+      nullptr, cmsDeleteTransform);
+  PooledVector<uint8_t> pixels2;
+  if (cmyk) {
     cmsUInt32Number in_type;
     if (dinfo->saw_Adobe_marker) {
-      in_type = TYPE_CMYK_8_REV;
+      in_type = bits == 16 ? TYPE_CMYK_16_REV : TYPE_CMYK_8_REV;
     } else {
-      in_type = TYPE_CMYK_8;
+      in_type = bits == 16 ? TYPE_CMYK_16 : TYPE_CMYK_8;
     }
 
-    cmsHTRANSFORM transform = cmsCreateTransform(
+    transform.reset(cmsCreateTransform(
         cmyk_profile, in_type, cmyk_target_profile, TYPE_RGB_16,
-        cmsGetHeaderRenderingIntent(cmyk_profile), 0);
+        cmsGetHeaderRenderingIntent(cmyk_profile), 0));
     if (!transform) {
       throw std::runtime_error("Failed to create CMYK <-> RGB transform");
     }
-    cmsDoTransform(transform, pixels2.data(), pixels.data(),
-                   info.width * info.height);
+    uint32_t rows = scanlines ? std::min(height, CMYK_STRIPE_ROWS) : height;
+    pixels2.resize((size_t)rows * info.width * 4 * bytes);
   }
+  uint8_t *ppixels = cmyk ? pixels2.data() : pixels.data();
 
-  d->finished_reading = true;
+  // rows of the CMYK samples at cmyk to rows of the RGB output from row
+  auto cmyk_to_rgb = [&](const uint8_t *cmyk, uint32_t row, uint32_t rows) {
+    size_t stride = (size_t)info.width * info.components * (info.bits >> 3);
+    cmsDoTransform(transform.get(), cmyk, pixels.data() + stride * row,
+                   info.width * rows);
+  };
+
+  if (convert) {
+    decode_converted(s, ppixels, height, bits, workers);
+  } else if (pipelined) {
+    std::vector<Plane> planes;
+    if (info.planar) {
+      planes = component_planes(s, height, bytes);
+    } else {
+      size_t nc = luma_only ? 1 : dinfo->num_components;
+      for (size_t c = 0; c < nc; c++) {
+        planes.push_back({c * bytes, (size_t)info.width * nc, nc, info.width,
+                          height});
+      }
+    }
+    decode_pipelined(s, ppixels, planes, bits, std::max<uint32_t>(workers, 1));
+  } else if (scanlines) {
+    jpeg_start_decompress(dinfo);
+    size_t samples = (size_t)info.width * dinfo->out_color_components;
+    size_t stride = samples * bytes;
+    uint32_t stripe = cmyk ? (uint32_t)(pixels2.size() / stride) : UINT32_MAX;
+
+    // rows of other precisions or for other output are read at the JPEG's
+    // precision and scaled
+    bool scaled = wide || bits != 8;
+    float scale[MAX_COMPONENTS];
+    float offset[MAX_COMPONENTS];
+    PooledVector<uint16_t> wide_row(scaled ? samples : 0);
+    PooledVector<uint8_t> narrow_row(scaled && !wide ? samples : 0);
+    if (scaled)
+      precision_scale(dinfo, bits, scale, offset);
+
+    for (uint32_t y = 0; y < dinfo->output_height; y++) {
+      uint8_t *row_ptr = ppixels + stride * (y % stripe);
+      if (scaled) {
+        read_wide_row(dinfo, wide_row.data(), narrow_row);
+        store_scaled(wide_row.data(), row_ptr, samples,
+                     dinfo->out_color_components, bits, scale, offset);
+      } else {
+        jpeg_read_scanlines(dinfo, &row_ptr, 1);
+      }
+      if (cmyk && (y % stripe == stripe - 1 || y + 1 == dinfo->output_height))
+        cmyk_to_rgb(pixels2.data(), y - y % stripe, y % stripe + 1);
+    }
+    jpeg_finish_decompress(dinfo);
+  } else if (info.color == VSColorFamily::cfYUV) {
+    decode_raw(s, ppixels, component_planes(s, height, bytes));
+  } else {
+    throw std::runtime_error("huh?");
+  }
+
+  // the stripes of a whole image are transformed in parallel
+  if (cmyk && !scanlines) {
+    size_t stride = (size_t)info.width * 4 * bytes;
+    parallel_for(pool, 0, height,
+                 (height + CMYK_STRIPE_ROWS - 1) / CMYK_STRIPE_ROWS,
+                 [&](uint32_t top, uint32_t bottom) {
+                   cmyk_to_rgb(pixels2.data() + stride * top, top,
+                               bottom - top);
+                 });
+  }
 
   return pixels;
 }
+
+std::unique_ptr<JpegDecoder> open_jpeg(const JpegOptions &options,
+                                       std::vector<uint8_t> *data,
+                                       std::shared_ptr<const JpegIndex> index) {
+  // the decoder closes its profiles
+  cmsHPROFILE cmyk_profile = nullptr;
+  if (!options.cmyk_profile.empty()) {
+    cmyk_profile = cmsOpenProfileFromFile(options.cmyk_profile.c_str(), "r");
+    if (!cmyk_profile) {
+      throw std::runtime_error("jpeg_cmyk_profile: Bad profile");
+    }
+    if (cmsGetColorSpace(cmyk_profile) != cmsSigCmykData) {
+      throw std::runtime_error("jpeg_cmyk_profile: Not CMYK profile");
+    }
+  }
+  cmsHPROFILE cmyk_target_profile = nullptr;
+  if (options.cmyk_target_profile == "srgb") {
+    cmyk_target_profile = cmsCreate_sRGBProfile();
+  } else if (!options.cmyk_target_profile.empty()) {
+    cmyk_target_profile =
+        cmsOpenProfileFromFile(options.cmyk_target_profile.c_str(), "r");
+    if (!cmyk_target_profile) {
+      throw std::runtime_error("jpeg_cmyk_target_profile: Bad profile");
+    }
+    if (cmsGetColorSpace(cmyk_target_profile) != cmsSigRgbData) {
+      throw std::runtime_error("jpeg_cmyk_target_profile: Not RGB profile");
+    }
+  }
+
+  return std::make_unique<JpegDecoder>(
+      data, options.subsampling_pad, options.rgb, options.fancy_upsampling,
+      cmyk_profile, cmyk_target_profile, options.band_top, options.band_height,
+      options.threads, options.pipeline, options.index_rows, options.index,
+      std::move(index), options.bits, options.dct_method, options.preview,
+      options.preview_dc, options.max_memory, options.luma_only);
+}
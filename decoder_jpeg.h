@@ -1,6 +1,9 @@
 #pragma once
 
 #include "decoder_base.h"
+#include "exif.h"
+#include "jpeg_coefficients.h"
+#include "jpeg_index.h"
 #include "jpeglib.h"
 
 class JpegDecodeSession {
@@ -11,25 +14,89 @@ public:
   jpeg_decompress_struct jinfo = jpeg_decompress_struct{};
   cmsHPROFILE src_profile = nullptr;
   bool finished_reading = false;
+  std::unique_ptr<JpegCoefficients> coefficients;
 
   cmsHPROFILE get_color_profile();
-  JpegDecodeSession(std::vector<uint8_t> *data);
+  // TIFF data of the EXIF APP1 segment, nullptr if there is none
+  const uint8_t *exif(size_t *size);
+  // XMP packet of the APP1 segment, nullptr if there is none
+  const uint8_t *xmp(size_t *size);
+  JpegDecodeSession(std::vector<uint8_t> *data, size_t max_memory);
   ~JpegDecodeSession() { jpeg_destroy_decompress(&jinfo); };
 };
 
 class JpegDecoder : public BaseDecoder {
 private:
+  // where the samples of one component go in an output buffer, with the
+  // offset in bytes and stride and step in samples
+  struct Plane {
+    size_t offset;
+    size_t stride;
+    size_t step;
+    uint32_t width;
+    uint32_t height;
+  };
+
   std::unique_ptr<JpegDecodeSession> d;
+  // the JPEG sessions read, which is a copy of the file cut after the
+  // preview's scans for progressive previews
+  std::vector<uint8_t> *source;
+  std::vector<uint8_t> preview;
+  // one sample per block from the DC coefficients, at 1/8 of the size
+  bool preview_dc;
   bool subsampling_pad;
   bool rgb;
   bool fancy_upsampling;
+  // JDCT_IFAST also skips block smoothing and fancy upsampling
+  J_DCT_METHOD dct_method;
   cmsHPROFILE cmyk_profile;
   cmsHPROFILE cmyk_target_profile;
+  uint32_t band_top = 0;
+  uint32_t full_height;
+  uint32_t threads;
+  bool pipeline;
+  // bytes of coefficients held in memory before the rest go to a temporary
+  // file, 0 for no limit
+  size_t max_memory;
+  // gray output of the luma alone, without decoding the chroma components
+  // past their entropy coded data
+  bool luma_only;
+  // output is the IDCT output as is, without upsampling or color conversion
+  bool direct;
+  // components are upsampled by the plugin, converting YCbCr to RGB for
+  // RGB output
+  bool convert;
+  std::shared_ptr<const JpegIndex> index;
+
+  uint32_t padded_height(uint32_t height);
+  size_t output_size(uint32_t height);
+  void prepare_cmyk();
+  PooledVector<uint8_t> decode_session(JpegDecodeSession &s, uint32_t height,
+                                       uint32_t workers);
+  std::vector<Plane> component_planes(JpegDecodeSession &s, uint32_t height,
+                                     size_t bytes);
+  void decode_raw(JpegDecodeSession &s, uint8_t *out,
+                  const std::vector<Plane> &planes);
+  void decode_pipelined(JpegDecodeSession &s, uint8_t *out,
+                        const std::vector<Plane> &planes, uint32_t bits,
+                        uint32_t workers);
+  void decode_converted(JpegDecodeSession &s, uint8_t *out, uint32_t height,
+                        uint32_t bits, uint32_t workers);
+  void copy_rows(const uint8_t *src, uint32_t src_height, uint32_t src_row,
+                 uint8_t *dst, uint32_t dst_height, uint32_t dst_row,
+                 uint32_t rows);
+  PooledVector<uint8_t> decode_indexed();
 
 public:
   JpegDecoder(std::vector<uint8_t> *data, bool subsampling_pad, bool rgb,
               bool fancy_upsampling, cmsHPROFILE cmyk_profile,
-              cmsHPROFILE cmyk_target_profile);
+              cmsHPROFILE cmyk_target_profile, uint32_t band_top,
+              uint32_t band_height, uint32_t threads, bool pipeline,
+              uint32_t index_spacing, const std::string &index_path,
+              std::shared_ptr<const JpegIndex> shared_index,
+              uint32_t output_bits, J_DCT_METHOD dct_method,
+              uint32_t preview_scans, bool preview_dc, size_t max_memory,
+              bool luma_only);
   ~JpegDecoder() {
     if (cmyk_profile) {
       cmsCloseProfile(cmyk_profile);
@@ -39,11 +106,56 @@ public:
     }
   };
 
-  std::vector<uint8_t> decode() override;
+  PooledVector<uint8_t> decode() override;
   cmsHPROFILE get_color_profile() override { return d->src_profile; };
   std::string get_name() override { return "JPEG"; };
+  // the MCU row index the decoder built or was given, null without one
+  std::shared_ptr<const JpegIndex> shared_index() const { return index; }
+
+  // the JPEG thumbnail in the EXIF data of a JPEG, empty if it has none,
+  // and the orientation of the JPEG, which the thumbnail is stored in too
+  static std::vector<uint8_t> exif_thumbnail(std::vector<uint8_t> *data,
+                                             uint32_t *orientation);
+
+  // the images of a Multi-Picture Format JPEG, offsets from the start of
+  // the file and the first image included, that start like JPEGs and fit the
+  // file. Empty for other JPEGs.
+  static std::vector<MpfImage> mpf_images(const std::vector<uint8_t> &data);
 
-  static bool is_jpeg(uint8_t *data) {
+  // the bytes of the segments before the first scan and of its SOS segment,
+  // which is all opening a decoder reads, 0 when data ends before them or
+  // they can't be walked
+  static size_t header_size(const std::vector<uint8_t> &data);
+
+  static bool is_jpeg(const uint8_t *data) {
     return data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF;
   };
 };
+
+// Options of the JPEG decoders a source opens, the constructor's arguments
+// with their defaults
+struct JpegOptions {
+  bool subsampling_pad = true;
+  bool rgb = false;
+  bool fancy_upsampling = true;
+  std::string cmyk_profile;
+  std::string cmyk_target_profile;
+  uint32_t band_top = 0;
+  uint32_t band_height = 0;
+  uint32_t threads = 1;
+  bool pipeline = false;
+  uint32_t index_rows = 0;
+  std::string index;
+  uint32_t bits = 8;
+  J_DCT_METHOD dct_method = JDCT_ISLOW;
+  uint32_t preview = 0;
+  bool preview_dc = false;
+  size_t max_memory = 0;
+  bool luma_only = false;
+};
+
+// A decoder with the options, opening the CMYK profiles from their paths,
+// and the index a previous decoder of the same data built if there is one
+std::unique_ptr<JpegDecoder>
+open_jpeg(const JpegOptions &options, std::vector<uint8_t> *data,
+          std::shared_ptr<const JpegIndex> index = nullptr);
@@ -1,12 +1,19 @@
 #include "decoder_png.h"
+#include "exif.h"
+#include "profiles.h"
 
 #include "lcms2.h"
 #include <algorithm>
 #include <iostream>
 #include <string.h>
 
-PngDecoder::PngDecoder(std::vector<uint8_t> *data)
-    : BaseDecoder(data), d(std::make_unique<PngDecodeSession>(data)) {
+PngDecoder::PngDecoder(std::vector<uint8_t> *data, bool trusted,
+                       uint32_t preview_passes, uint32_t band_top,
+                       uint32_t band_height, uint32_t index_spacing,
+                       const std::string &index_path,
+                       std::shared_ptr<const PngIndex> shared_index)
+    : BaseDecoder(data), d(std::make_unique<PngDecodeSession>(data, trusted)),
+      trusted(trusted), band_top(band_top) {
 
   auto color_type = png_get_color_type(d->png, d->pinfo);
 
@@ -17,37 +24,64 @@ PngDecoder::PngDecoder(std::vector<uint8_t> *data)
     components = png_get_channels(d->png, d->pinfo);
   }
 
+  // palette and low bit depth gray are expanded to 8 bits by the session
+  uint32_t bits = std::max<uint32_t>(png_get_bit_depth(d->png, d->pinfo), 8);
+
+  uint32_t width = png_get_image_width(d->png, d->pinfo);
+  uint32_t height = png_get_image_height(d->png, d->pinfo);
+
+  // adam7 passes 1, 3 and 5 complete a grid of every 8th, 4th and 2nd pixel
+  if (preview_passes > 0 &&
+      png_get_interlace_type(d->png, d->pinfo) == PNG_INTERLACE_ADAM7) {
+    this->preview_passes = preview_passes;
+    preview_shift = 3 - (preview_passes - 1) / 2;
+    width = (width + (1 << preview_shift) - 1) >> preview_shift;
+    height = (height + (1 << preview_shift) - 1) >> preview_shift;
+  }
+
+  if (band_top > 0 || band_height > 0) {
+    if (this->preview_passes > 0) {
+      throw std::runtime_error("band: Not supported with png_preview");
+    }
+    if (band_height == 0) {
+      band_height = height > band_top ? height - band_top : 0;
+    }
+    if (band_height == 0 || (uint64_t)band_top + band_height > height) {
+      throw std::runtime_error("band: Outside of the image");
+    }
+    height = band_height;
+  }
+
+  if (shared_index) {
+    // built for the same data by an earlier decoder
+    index = std::move(shared_index);
+  } else if (index_spacing > 0 || !index_path.empty()) {
+    index = std::make_unique<PngIndex>(
+        *data, index_spacing > 0 ? index_spacing : 256, index_path);
+  }
+
   info = {
-      .width = png_get_image_width(d->png, d->pinfo),
-      .height = png_get_image_height(d->png, d->pinfo),
+      .width = width,
+      .height = height,
       .components = components,
       .has_alpha = (bool)(color_type & PNG_COLOR_MASK_ALPHA),
       .color = color_type & PNG_COLOR_MASK_COLOR ? VSColorFamily::cfRGB
                                                  : VSColorFamily::cfGray,
       .sample_type = VSSampleType::stInteger,
-      .bits = png_get_bit_depth(d->png, d->pinfo),
+      .bits = bits,
   };
-}
-
-static void PNGDoGammaCorrection(png_structp png, png_infop pinfo) {
-  if (!png_get_valid(png, pinfo, PNG_INFO_gAMA))
-    return;
 
-  double aGamma;
-
-  if (png_get_gAMA(png, pinfo, &aGamma)) {
-    if ((aGamma <= 0.0) || (aGamma > 21474.83)) {
-      aGamma = 0.45455;
-      png_set_gAMA(png, pinfo, aGamma);
-    }
-    png_set_gamma(png, 2.2, aGamma);
-  } else {
-    png_set_gamma(png, 2.2, 0.45455);
-  }
+#ifdef PNG_eXIf_SUPPORTED
+  // only an eXIf chunk before the image data is seen here
+  png_bytep exif;
+  png_uint_32 exif_size;
+  if (png_get_eXIf_1(d->png, d->pinfo, &exif_size, &exif))
+    info.orientation = parse_exif(exif, exif_size).orientation;
+#endif
 }
 
-PngDecodeSession::PngDecodeSession(std::vector<uint8_t> *data)
-    : m_data(data), m_remain(data->size()) {
+PngDecodeSession::PngDecodeSession(std::vector<uint8_t> *data, bool trusted)
+    : m_data(data), m_trusted(trusted), m_remain(data->size()) {
   auto errorFn = [](png_struct *, png_const_charp msg) {
     throw std::runtime_error(msg);
   };
@@ -76,6 +110,26 @@ PngDecodeSession::PngDecodeSession(std::vector<uint8_t> *data)
   };
 
   png_set_read_fn(png, (void *)this, readFn);
+
+  if (m_trusted) {
+    // integrity is checked by whoever produced the file, skip chunk CRCs and
+    // the zlib Adler-32
+    png_set_crc_action(png, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+#ifdef PNG_SET_OPTION_SUPPORTED
+    png_set_option(png, PNG_IGNORE_ADLER32, PNG_OPTION_ON);
+    png_set_option(png, PNG_SKIP_sRGB_CHECK_PROFILE, PNG_OPTION_ON);
+#endif
+
+#ifdef PNG_HANDLE_AS_UNKNOWN_SUPPORTED
+    // ignore every ancillary chunk except the ones describing color and
+    // orientation
+    static const png_byte kept_chunks[] = "iCCP\0gAMA\0cHRM\0sRGB\0eXIf";
+    png_set_keep_unknown_chunks(png, PNG_HANDLE_CHUNK_NEVER, nullptr, -1);
+    png_set_keep_unknown_chunks(png, PNG_HANDLE_CHUNK_AS_DEFAULT,
+                                kept_chunks, 5);
+#endif
+  }
+
   png_read_info(png, pinfo);
 
   auto color_type = png_get_color_type(png, pinfo);
@@ -88,17 +142,14 @@ PngDecodeSession::PngDecodeSession(std::vector<uint8_t> *data)
 
   png_set_swap(png);
 
-  if (!get_color_profile()) {
-    if (png_get_valid(png, pinfo, PNG_INFO_gAMA) &&
-        png_get_valid(png, pinfo, PNG_INFO_cHRM)) {
-      png_set_gray_to_rgb(png);
-
-      PNGDoGammaCorrection(png, pinfo);
-    }
-  }
+  // samples are passed through as stored, any encoding gamma is carried by
+  // the profile and applied by ConvertColor
+  get_color_profile();
 }
 
-bool PngDecodeSession::get_color_profile() {
+void PngDecodeSession::get_color_profile() {
+  bool rgb = png_get_color_type(png, pinfo) & PNG_COLOR_MASK_COLOR;
+
   if (png_get_valid(png, pinfo, PNG_INFO_iCCP)) {
     png_charp name;
     png_bytep icc_data;
@@ -109,16 +160,12 @@ bool PngDecodeSession::get_color_profile() {
     src_profile = cmsOpenProfileFromMem(icc_data, icc_size);
     cmsColorSpaceSignature profileSpace = cmsGetColorSpace(src_profile);
 
-    auto color_type = png_get_color_type(png, pinfo);
-
-    bool rgb = color_type & PNG_COLOR_MASK_COLOR;
-
     if ((rgb && profileSpace != cmsSigRgbData) ||
         (!rgb && profileSpace != cmsSigGrayData)) {
       cmsCloseProfile(src_profile);
       src_profile = nullptr;
     } else {
-      return true;
+      return;
     }
   }
 
@@ -139,33 +186,62 @@ bool PngDecodeSession::get_color_profile() {
     cmsToneCurve *cmsgamma[3];
     cmsgamma[0] = cmsgamma[1] = cmsgamma[2] = cmsBuildGamma(NULL, 1.0 / gamma);
 
-    src_profile = cmsCreateRGBProfile(&whitepoint, &primaries, cmsgamma);
+    if (rgb) {
+      src_profile = cmsCreateRGBProfile(&whitepoint, &primaries, cmsgamma);
+    } else {
+      src_profile = cmsCreateGrayProfile(&whitepoint, cmsgamma[0]);
+    }
 
     cmsFreeToneCurve(cmsgamma[0]);
-    return false;
+    return;
   }
 
   if (png_get_valid(png, pinfo, PNG_INFO_sRGB)) {
     int intent;
-    png_set_gray_to_rgb(png);
     png_get_sRGB(png, pinfo, &intent);
-    src_profile = cmsCreate_sRGBProfile();
+    src_profile = rgb ? cmsCreate_sRGBProfile() : create_sRGB_gray();
     cmsSetHeaderRenderingIntent(src_profile, intent);
-    return true;
   }
+}
 
-  return false;
+size_t PngDecoder::header_size(const std::vector<uint8_t> &data) {
+  size_t pos = 8;
+  while (pos + 8 <= data.size()) {
+    size_t length = ((size_t)data[pos] << 24) | (data[pos + 1] << 16) |
+                    (data[pos + 2] << 8) | data[pos + 3];
+    if (memcmp(data.data() + pos + 4, "IDAT", 4) == 0)
+      return pos + 8;
+    pos += 12 + length;
+  }
+  return 0;
 }
 
-std::vector<uint8_t> PngDecoder::decode() {
+PooledVector<uint8_t> PngDecoder::decode() {
   if (d->finished_reading)
-    d = std::make_unique<PngDecodeSession>(m_data);
+    d = std::make_unique<PngDecodeSession>(m_data, trusted);
 
   int stride = info.width * info.components * (info.bits == 8 ? 1 : 2);
 
-  std::vector<uint8_t> pixels(info.height * stride);
+  PooledVector<uint8_t> pixels((size_t)info.height * stride);
+
+  if (index) {
+    index->read_rows(*m_data, band_top, info.height, pixels.data(), stride);
+    return pixels;
+  }
+
+  if (preview_passes > 0) {
+    decode_preview(pixels.data(), stride);
+    d->finished_reading = true;
+    return pixels;
+  }
+
+  if (info.height != png_get_image_height(d->png, d->pinfo)) {
+    decode_band(pixels.data(), stride);
+    d->finished_reading = true;
+    return pixels;
+  }
 
-  std::vector<png_bytep> row_pointers(info.height);
+  PooledVector<png_bytep> row_pointers(info.height);
   for (uint32_t y = 0; y < info.height; y++) {
     row_pointers[y] = pixels.data() + (y * stride);
   }
@@ -176,3 +252,63 @@ std::vector<uint8_t> PngDecoder::decode() {
 
   return pixels;
 }
+
+void PngDecoder::decode_preview(uint8_t *pixels, size_t stride) {
+  // without interlace handling libpng returns each pass as its own reduced
+  // image, so reading stops after the requested passes
+  png_read_update_info(d->png, d->pinfo);
+
+  uint32_t width = png_get_image_width(d->png, d->pinfo);
+  uint32_t height = png_get_image_height(d->png, d->pinfo);
+  size_t pixel_size = info.components * (info.bits == 8 ? 1 : 2);
+
+  PooledVector<uint8_t> row(png_get_rowbytes(d->png, d->pinfo));
+
+  for (uint32_t pass = 0; pass < preview_passes; pass++) {
+    uint32_t cols = PNG_PASS_COLS(width, pass);
+    uint32_t rows = PNG_PASS_ROWS(height, pass);
+    if (cols == 0 || rows == 0)
+      continue;
+
+    for (uint32_t j = 0; j < rows; j++) {
+      png_read_row(d->png, row.data(), nullptr);
+
+      uint8_t *dst =
+          pixels + (PNG_ROW_FROM_PASS_ROW(j, pass) >> preview_shift) * stride;
+      for (uint32_t i = 0; i < cols; i++) {
+        memcpy(dst + (PNG_COL_FROM_PASS_COL(i, pass) >> preview_shift) *
+                         pixel_size,
+               row.data() + i * pixel_size, pixel_size);
+      }
+    }
+  }
+}
+
+void PngDecoder::decode_band(uint8_t *pixels, size_t stride) {
+  uint32_t height = png_get_image_height(d->png, d->pinfo);
+
+  // every adam7 pass spans the whole image, cut the band from a full decode
+  if (png_get_interlace_type(d->png, d->pinfo) == PNG_INTERLACE_ADAM7) {
+    PooledVector<uint8_t> image(height * stride);
+    PooledVector<png_bytep> row_pointers(height);
+    for (uint32_t y = 0; y < height; y++) {
+      row_pointers[y] = image.data() + (y * stride);
+    }
+
+    png_read_image(d->png, row_pointers.data());
+
+    memcpy(pixels, image.data() + band_top * stride, info.height * stride);
+    return;
+  }
+
+  png_read_update_info(d->png, d->pinfo);
+
+  PooledVector<uint8_t> row(stride);
+  for (uint32_t y = 0; y < band_top; y++) {
+    png_read_row(d->png, row.data(), nullptr);
+  }
+
+  for (uint32_t y = 0; y < info.height; y++) {
+    png_read_row(d->png, pixels + y * stride, nullptr);
+  }
+}
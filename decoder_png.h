@@ -2,12 +2,14 @@
 
 #include "decoder_base.h"
 #include "png.h"
+#include "png_index.h"
 
 class PngDecodeSession {
 private:
-  bool get_color_profile();
+  void get_color_profile();
 
   std::vector<uint8_t> *m_data;
+  bool m_trusted;
   size_t m_read = 0;
   size_t m_remain;
 
@@ -18,7 +20,7 @@ public:
   cmsHPROFILE src_profile = nullptr;
   bool finished_reading = false;
 
-  PngDecodeSession(std::vector<uint8_t> *data);
+  PngDecodeSession(std::vector<uint8_t> *data, bool trusted);
   ~PngDecodeSession() {
     if (src_profile) {
       cmsCloseProfile(src_profile);
@@ -31,13 +33,30 @@ public:
 class PngDecoder : public BaseDecoder {
 private:
   std::unique_ptr<PngDecodeSession> d;
+  bool trusted;
+  uint32_t preview_passes = 0;
+  uint32_t preview_shift = 0;
+  uint32_t band_top = 0;
+  std::shared_ptr<const PngIndex> index;
+
+  void decode_preview(uint8_t *pixels, size_t stride);
+  void decode_band(uint8_t *pixels, size_t stride);
 
 public:
-  PngDecoder(std::vector<uint8_t> *data);
+  PngDecoder(std::vector<uint8_t> *data, bool trusted, uint32_t preview_passes,
+             uint32_t band_top, uint32_t band_height, uint32_t index_spacing,
+             const std::string &index_path,
+             std::shared_ptr<const PngIndex> shared_index);
 
-  std::vector<uint8_t> decode() override;
+  PooledVector<uint8_t> decode() override;
   cmsHPROFILE get_color_profile() override { return d->src_profile; };
   std::string get_name() override { return "PNG"; };
+  // the row index the decoder built or was given, null without one
+  std::shared_ptr<const PngIndex> shared_index() const { return index; }
+
+  // the bytes up to the chunk header of the first IDAT, which is all
+  // opening a decoder reads, 0 when data ends before it
+  static size_t header_size(const std::vector<uint8_t> &data);
 
   static bool is_png(uint8_t *data) {
     return data[0] == 0x89 && data[1] == 'P' && data[2] == 'N' &&
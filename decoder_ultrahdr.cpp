@@ -0,0 +1,150 @@
+#include "decoder_ultrahdr.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+// rows of the stripes the gains are applied in, in parallel
+constexpr uint32_t GAIN_STRIPE_ROWS = 64;
+
+// VapourSynth primaries of an RGB profile, told apart by the D50 adapted
+// colorants of its red and green, unspecified for ones that aren't sRGB,
+// Display P3 or BT.2020
+uint32_t profile_primaries(cmsHPROFILE profile) {
+  if (!profile)
+    return 1;
+  auto *red = static_cast<cmsCIEXYZ *>(cmsReadTag(profile,
+                                                  cmsSigRedColorantTag));
+  auto *green = static_cast<cmsCIEXYZ *>(cmsReadTag(profile,
+                                                    cmsSigGreenColorantTag));
+  if (!red || !green)
+    return 2;
+
+  auto near = [](const cmsCIEXYZ *c, double x, double y, double z) {
+    return std::abs(c->X - x) < 0.01 && std::abs(c->Y - y) < 0.01 &&
+           std::abs(c->Z - z) < 0.01;
+  };
+  if (near(red, 0.4361, 0.2225, 0.0139) && near(green, 0.3851, 0.7169, 0.0971))
+    return 1;
+  if (near(red, 0.5151, 0.2412, -0.0011) &&
+      near(green, 0.2920, 0.6922, 0.0419))
+    return 12;
+  if (near(red, 0.6734, 0.2790, -0.0019) &&
+      near(green, 0.1656, 0.6753, 0.0299))
+    return 9;
+  return 2;
+}
+} // namespace
+
+UltraHdrDecoder::UltraHdrDecoder(std::vector<uint8_t> *data,
+                                 std::unique_ptr<JpegDecoder> base,
+                                 std::vector<uint8_t> gainmap_data,
+                                 const GainMapMetadata &metadata, bool pq)
+    : BaseDecoder(data), base(std::move(base)),
+      gainmap_data(std::move(gainmap_data)), metadata(metadata), pq(pq) {
+  if (metadata.base_hdr) {
+    throw std::runtime_error("jpeg_gainmap: HDR base images are not "
+                             "supported");
+  }
+  if (this->base->info.color != VSColorFamily::cfRGB ||
+      this->base->info.bits != 32) {
+    throw std::runtime_error("jpeg_gainmap: Only color base images are "
+                             "supported");
+  }
+
+  JpegOptions options;
+  options.rgb = true;
+  options.bits = 32;
+  gainmap = open_jpeg(options, &this->gainmap_data);
+
+  info = this->base->info;
+  info.transfer = pq ? 16 : 8;
+  info.primaries = profile_primaries(this->base->get_color_profile());
+}
+
+bool UltraHdrDecoder::find_gainmap(const std::vector<uint8_t> &data,
+                                   std::vector<uint8_t> *gainmap,
+                                   GainMapMetadata *metadata) {
+  std::vector<MpfImage> images = JpegDecoder::mpf_images(data);
+  for (size_t i = 1; i < images.size(); i++) {
+    auto begin = data.begin() + images[i].offset;
+    std::vector<uint8_t> image(begin, begin + images[i].size);
+    JpegDecodeSession s(&image, 0);
+    size_t size;
+    const uint8_t *xmp = s.xmp(&size);
+    if (xmp && parse_gainmap_xmp(reinterpret_cast<const char *>(xmp), size,
+                                 metadata)) {
+      *gainmap = std::move(image);
+      return true;
+    }
+  }
+  return false;
+}
+
+PooledVector<uint8_t> UltraHdrDecoder::decode() {
+  base->pool = pool;
+  gainmap->pool = pool;
+  PooledVector<uint8_t> pixels = base->decode();
+  PooledVector<uint8_t> gain_pixels = gainmap->decode();
+
+  // log2 gains at the gain map's size, for the full HDR capacity
+  const ImageInfo &g = gainmap->info;
+  size_t gain_size = (size_t)g.width * g.height;
+  PooledVector<float> gains(gain_size * 3);
+  for (int c = 0; c < 3; c++) {
+    const float *in = reinterpret_cast<const float *>(gain_pixels.data());
+    size_t step = 1;
+    if (g.planar) {
+      in += gain_size * c;
+    } else {
+      in += g.components == 1 ? 0 : c;
+      step = g.components;
+    }
+    float min = metadata.min[c];
+    float range = metadata.max[c] - min;
+    float gamma = 1 / metadata.gamma[c];
+    float *out = gains.data() + gain_size * c;
+    for (size_t i = 0; i < gain_size; i++) {
+      float r = std::min(std::max(in[i * step], 0.f), 1.f);
+      if (gamma != 1)
+        r = std::pow(r, gamma);
+      out[i] = min + range * r;
+    }
+  }
+
+  // each output row gets a row of gains interpolated between the two
+  // nearest gain map rows, which the kernel interpolates across
+  size_t plane = (size_t)info.width * info.height;
+  size_t step = info.planar ? 1 : 3;
+  float *samples = reinterpret_cast<float *>(pixels.data());
+  float gain_scale_x = (float)g.width / info.width;
+  float gain_scale_y = (float)g.height / info.height;
+  auto apply = [&](uint32_t top, uint32_t bottom) {
+    PooledVector<float> row((size_t)g.width * 3);
+    for (uint32_t y = top; y < bottom; y++) {
+      float gy = std::min(std::max((y + 0.5f) * gain_scale_y - 0.5f, 0.f),
+                          (float)(g.height - 1));
+      uint32_t y0 = (uint32_t)gy;
+      uint32_t y1 = std::min(y0 + 1, g.height - 1);
+      float f = gy - y0;
+      const float *gain_rows[3];
+      float *rows[3];
+      for (int c = 0; c < 3; c++) {
+        const float *g0 = gains.data() + gain_size * c + (size_t)y0 * g.width;
+        const float *g1 = gains.data() + gain_size * c + (size_t)y1 * g.width;
+        float *r = row.data() + (size_t)g.width * c;
+        for (uint32_t x = 0; x < g.width; x++)
+          r[x] = g0[x] + (g1[x] - g0[x]) * f;
+        gain_rows[c] = r;
+        rows[c] = info.planar ? samples + plane * c + (size_t)y * info.width
+                              : samples + (size_t)y * info.width * 3 + c;
+      }
+      gainmap_apply_row(rows, step, gain_rows, g.width, gain_scale_x,
+                        metadata, pq, rows, info.width);
+    }
+  };
+  parallel_for(pool, 0, info.height,
+               (info.height + GAIN_STRIPE_ROWS - 1) / GAIN_STRIPE_ROWS, apply);
+  return pixels;
+}
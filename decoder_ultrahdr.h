@@ -0,0 +1,33 @@
+#pragma once
+
+#include "decoder_jpeg.h"
+#include "gainmap.h"
+
+// Ultra HDR and other gain map JPEGs, an SDR base image with a gain map image
+// in its MPF index, decoded to HDR float RGB in linear light or PQ. The base
+// decoder outputs float RGB, and the gain map is decoded at its own size and
+// upsampled while it is applied.
+class UltraHdrDecoder : public BaseDecoder {
+private:
+  std::unique_ptr<JpegDecoder> base;
+  std::vector<uint8_t> gainmap_data;
+  std::unique_ptr<JpegDecoder> gainmap;
+  GainMapMetadata metadata;
+  bool pq;
+
+public:
+  UltraHdrDecoder(std::vector<uint8_t> *data, std::unique_ptr<JpegDecoder> base,
+                  std::vector<uint8_t> gainmap_data,
+                  const GainMapMetadata &metadata, bool pq);
+
+  PooledVector<uint8_t> decode() override;
+  // the samples are described by info.transfer and info.primaries instead
+  cmsHPROFILE get_color_profile() override { return nullptr; };
+  std::string get_name() override { return "JPEG"; };
+
+  // the first image of the MPF index after the base image that has gain map
+  // metadata in its XMP, false if there is none
+  static bool find_gainmap(const std::vector<uint8_t> &data,
+                           std::vector<uint8_t> *gainmap,
+                           GainMapMetadata *metadata);
+};
@@ -0,0 +1,114 @@
+#include "exif.h"
+
+namespace {
+struct TiffReader {
+  const uint8_t *data;
+  size_t size;
+  bool big_endian;
+
+  bool fits(size_t pos, size_t length) const {
+    return pos <= size && length <= size - pos;
+  }
+
+  uint32_t u16(size_t pos) const {
+    return big_endian ? (data[pos] << 8) | data[pos + 1]
+                      : data[pos] | (data[pos + 1] << 8);
+  }
+
+  uint32_t u32(size_t pos) const {
+    return big_endian ? (u16(pos) << 16) | u16(pos + 2)
+                      : u16(pos) | (u16(pos + 2) << 16);
+  }
+
+  // the first value of a SHORT or LONG entry, which both fit in the entry
+  uint32_t value(size_t entry) const {
+    return u16(entry + 2) == 3 ? u16(entry + 8) : u32(entry + 8);
+  }
+
+  // calls f with the offset of each 12 byte entry and returns the offset of
+  // the next IFD, 0 at the end or for an IFD that doesn't fit
+  template <typename F> uint32_t ifd(uint32_t pos, F f) const {
+    if (pos < 8 || !fits(pos, 2))
+      return 0;
+    uint32_t count = u16(pos);
+    if (!fits(pos + 2, (size_t)count * 12 + 4))
+      return 0;
+    for (uint32_t i = 0; i < count; i++)
+      f(pos + 2 + (size_t)i * 12);
+    return u32(pos + 2 + (size_t)count * 12);
+  }
+};
+} // namespace
+
+ExifInfo parse_exif(const uint8_t *data, size_t size) {
+  ExifInfo exif;
+  if (size < 8)
+    return exif;
+
+  TiffReader tiff = {data, size, data[0] == 'M'};
+  if (!(data[0] == 'I' && data[1] == 'I') &&
+      !(data[0] == 'M' && data[1] == 'M'))
+    return exif;
+  if (tiff.u16(2) != 42)
+    return exif;
+
+  uint32_t ifd1 = tiff.ifd(tiff.u32(4), [&](size_t entry) {
+    if (tiff.u16(entry) == 0x0112) {
+      uint32_t orientation = tiff.value(entry);
+      if (orientation >= 1 && orientation <= 8)
+        exif.orientation = orientation;
+    }
+  });
+
+  // IFD1 describes the thumbnail
+  if (ifd1 == 0)
+    return exif;
+  size_t offset = 0;
+  size_t length = 0;
+  tiff.ifd(ifd1, [&](size_t entry) {
+    uint32_t tag = tiff.u16(entry);
+    if (tag == 0x0201)
+      offset = tiff.value(entry);
+    else if (tag == 0x0202)
+      length = tiff.value(entry);
+  });
+  if (length >= 3 && tiff.fits(offset, length) && data[offset] == 0xFF &&
+      data[offset + 1] == 0xD8 && data[offset + 2] == 0xFF) {
+    exif.thumbnail_offset = offset;
+    exif.thumbnail_length = length;
+  }
+  return exif;
+}
+
+std::vector<MpfImage> parse_mpf(const uint8_t *data, size_t size) {
+  std::vector<MpfImage> images;
+  if (size < 8)
+    return images;
+
+  TiffReader tiff = {data, size, data[0] == 'M'};
+  if (!(data[0] == 'I' && data[1] == 'I') &&
+      !(data[0] == 'M' && data[1] == 'M'))
+    return images;
+  if (tiff.u16(2) != 42)
+    return images;
+
+  // the MP Index IFD lists 16 byte entries, stored at an offset as UNDEFINED
+  // data too long to fit the IFD entry
+  size_t entries = 0;
+  size_t count = 0;
+  tiff.ifd(tiff.u32(4), [&](size_t entry) {
+    if (tiff.u16(entry) == 0xB002 && tiff.u16(entry + 2) == 7) {
+      count = tiff.u32(entry + 4) / 16;
+      entries = tiff.u32(entry + 8);
+    }
+  });
+  if (count == 0 || !tiff.fits(entries, count * 16))
+    return images;
+
+  for (size_t i = 0; i < count; i++) {
+    size_t entry = entries + i * 16;
+    images.push_back({tiff.u32(entry), tiff.u32(entry + 4),
+                      tiff.u32(entry + 8)});
+  }
+  return images;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// What the decoders use from an EXIF block, which is a TIFF header followed
+// by IFDs. Offsets are from the start of the TIFF header, and fields missing
+// from the block keep their defaults.
+struct ExifInfo {
+  // how the stored image is turned, 1 to 8 as in TIFF, 1 for upright
+  uint32_t orientation = 1;
+  // JPEG thumbnail of IFD1, length 0 if there is none
+  size_t thumbnail_offset = 0;
+  size_t thumbnail_length = 0;
+};
+
+// Parses the TIFF data of an EXIF block, without the "Exif\0\0" prefix of a
+// JPEG APP1 segment. Malformed blocks give an empty ExifInfo.
+ExifInfo parse_exif(const uint8_t *data, size_t size);
+
+// An MP entry of the APP2 MPF segment of a Multi-Picture Format JPEG, such as
+// a stereo or burst MPO file. The offset is from the start of the segment's
+// TIFF header, and 0 for the first image, which starts the file.
+struct MpfImage {
+  // image type and flags, the type in the low 24 bits
+  uint32_t attributes;
+  uint32_t size;
+  uint32_t offset;
+};
+
+// Parses the TIFF data of an MPF segment, without its "MPF\0" prefix.
+// Malformed segments give no images.
+std::vector<MpfImage> parse_mpf(const uint8_t *data, size_t size);
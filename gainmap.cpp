@@ -0,0 +1,308 @@
+#include "gainmap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string>
+#include <string_view>
+
+namespace {
+// The value of an hdrgm property, from an attribute or the content of an
+// element, empty when the packet has none
+std::string_view property(std::string_view xmp, std::string_view name) {
+  std::string key = "hdrgm:" + std::string(name);
+  size_t pos = 0;
+  while ((pos = xmp.find(key, pos)) != std::string_view::npos) {
+    size_t end = pos + key.size();
+    pos = end;
+    // a longer name
+    if (end < xmp.size() && isalnum((unsigned char)xmp[end]))
+      continue;
+
+    size_t p = end;
+    while (p < xmp.size() && isspace((unsigned char)xmp[p]))
+      p++;
+    if (p < xmp.size() && xmp[p] == '=') {
+      p++;
+      while (p < xmp.size() && isspace((unsigned char)xmp[p]))
+        p++;
+      if (p >= xmp.size() || (xmp[p] != '"' && xmp[p] != '\''))
+        continue;
+      size_t close = xmp.find(xmp[p], p + 1);
+      if (close == std::string_view::npos)
+        return {};
+      return xmp.substr(p + 1, close - p - 1);
+    }
+
+    if (end > key.size() && xmp[end - key.size() - 1] == '<') {
+      size_t open = xmp.find('>', end);
+      if (open == std::string_view::npos)
+        return {};
+      size_t close = xmp.find("</" + key, open);
+      if (close == std::string_view::npos)
+        return {};
+      return xmp.substr(open + 1, close - open - 1);
+    }
+  }
+  return {};
+}
+
+bool number(std::string_view text, float *value) {
+  std::string s(text);
+  char *end;
+  *value = strtof(s.c_str(), &end);
+  if (end == s.c_str())
+    return false;
+  while (isspace((unsigned char)*end))
+    end++;
+  return *end == 0;
+}
+
+// Reads one value for all channels, or one per channel from an rdf:Seq
+bool channels(std::string_view text, float *values) {
+  if (text.find("<rdf:li") == std::string_view::npos) {
+    if (!number(text, &values[0]))
+      return false;
+    values[1] = values[2] = values[0];
+    return true;
+  }
+
+  uint32_t count = 0;
+  size_t pos = 0;
+  while ((pos = text.find("<rdf:li", pos)) != std::string_view::npos) {
+    size_t open = text.find('>', pos);
+    size_t close = text.find('<', open);
+    if (open == std::string_view::npos || close == std::string_view::npos ||
+        count == 3 || !number(text.substr(open + 1, close - open - 1),
+                              &values[count]))
+      return false;
+    count++;
+    pos = close;
+  }
+  if (count == 1)
+    values[1] = values[2] = values[0];
+  return count == 1 || count == 3;
+}
+
+// sRGB EOTF and SMPTE ST 2084 inverse EOTF
+constexpr float PQ_M1 = 2610.f / 16384;
+constexpr float PQ_M2 = 2523.f / 4096 * 128;
+constexpr float PQ_C1 = 3424.f / 4096;
+constexpr float PQ_C2 = 2413.f / 4096 * 32;
+constexpr float PQ_C3 = 2392.f / 4096 * 32;
+// SDR white in nits, as in ITU-R BT.2408, over the 10000 of PQ
+constexpr float PQ_SDR_WHITE = 203.f / 10000;
+
+inline float srgb_to_linear(float v) {
+  v = std::min(std::max(v, 0.f), 1.f);
+  return v <= 0.04045f ? v * (1 / 12.92f)
+                       : std::pow((v + 0.055f) * (1 / 1.055f), 2.4f);
+}
+
+inline float linear_to_pq(float v) {
+  float y = std::pow(std::max(v * PQ_SDR_WHITE, 0.f), PQ_M1);
+  return std::pow((PQ_C1 + PQ_C2 * y) / (1 + PQ_C3 * y), PQ_M2);
+}
+
+void apply_row_generic(const float *const sdr[3], size_t step,
+                       const float *const gain[3], uint32_t gain_width,
+                       float gain_scale, const GainMapMetadata &metadata,
+                       bool pq, float *const out[3], uint32_t x,
+                       uint32_t width) {
+  float last = (float)(gain_width - 1);
+  for (; x < width; x++) {
+    float gx = std::min(std::max((x + 0.5f) * gain_scale - 0.5f, 0.f), last);
+    uint32_t i0 = (uint32_t)gx;
+    uint32_t i1 = std::min(i0 + 1, gain_width - 1);
+    float f = gx - i0;
+    for (int c = 0; c < 3; c++) {
+      float g = gain[c][i0] + (gain[c][i1] - gain[c][i0]) * f;
+      float v = (srgb_to_linear(sdr[c][x * step]) + metadata.offset_sdr[c]) *
+                    std::exp2(g) -
+                metadata.offset_hdr[c];
+      out[c][x * step] = pq ? linear_to_pq(v) : v;
+    }
+  }
+}
+} // namespace
+
+bool parse_gainmap_xmp(const char *xmp, size_t size,
+                       GainMapMetadata *metadata) {
+  std::string_view packet(xmp, size);
+  GainMapMetadata m;
+
+  std::string_view max = property(packet, "GainMapMax");
+  if (max.empty() || !channels(max, m.max))
+    return false;
+
+  std::string_view value;
+  if (!(value = property(packet, "GainMapMin")).empty() &&
+      !channels(value, m.min))
+    return false;
+  if (!(value = property(packet, "Gamma")).empty() &&
+      !channels(value, m.gamma))
+    return false;
+  if (!(value = property(packet, "OffsetSDR")).empty() &&
+      !channels(value, m.offset_sdr))
+    return false;
+  if (!(value = property(packet, "OffsetHDR")).empty() &&
+      !channels(value, m.offset_hdr))
+    return false;
+  if (!(value = property(packet, "HDRCapacityMin")).empty() &&
+      !number(value, &m.capacity_min))
+    return false;
+  // the capacity defaults to the largest gain
+  m.capacity_max = std::max({m.max[0], m.max[1], m.max[2]});
+  if (!(value = property(packet, "HDRCapacityMax")).empty() &&
+      !number(value, &m.capacity_max))
+    return false;
+  value = property(packet, "BaseRenditionIsHDR");
+  m.base_hdr = value == "True" || value == "true";
+
+  for (int c = 0; c < 3; c++) {
+    if (!(m.gamma[c] > 0))
+      return false;
+  }
+  *metadata = m;
+  return true;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GAINMAP_AVX2
+#include <immintrin.h>
+
+// 2^x with Cephes' exp2f polynomial, relative error below 2e-7
+__attribute__((target("avx2,fma"))) static inline __m256 exp2_ps(__m256 x) {
+  x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-126.f)),
+                    _mm256_set1_ps(127.f));
+  __m256 n = _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT |
+                                    _MM_FROUND_NO_EXC);
+  __m256 f = _mm256_sub_ps(x, n);
+  __m256 p = _mm256_set1_ps(1.535336188319500e-4f);
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.339887440266574e-3f));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(9.618437357674640e-3f));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(5.550332471162809e-2f));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(2.402264791363012e-1f));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(6.931472028550421e-1f));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.f));
+  __m256i e = _mm256_slli_epi32(
+      _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+// log2(x) of positive normal x with Cephes' logf polynomial on a mantissa
+// in [sqrt(1/2), sqrt(2))
+__attribute__((target("avx2,fma"))) static inline __m256 log2_ps(__m256 x) {
+  __m256i bits = _mm256_castps_si256(x);
+  __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(
+      _mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+  __m256 m = _mm256_castsi256_ps(_mm256_or_si256(
+      _mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)),
+      _mm256_set1_epi32(0x3F800000)));
+  __m256 big = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+  m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), big);
+  e = _mm256_add_ps(e, _mm256_and_ps(big, _mm256_set1_ps(1.f)));
+
+  __m256 t = _mm256_sub_ps(m, _mm256_set1_ps(1.f));
+  __m256 p = _mm256_set1_ps(7.0376836292e-2f);
+  p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(-1.1514610310e-1f));
+  p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(1.1676998740e-1f));
+  p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(-1.2420140846e-1f));
+  p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(1.4249322787e-1f));
+  p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(-1.6668057665e-1f));
+  p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(2.0000714765e-1f));
+  p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(-2.4999993993e-1f));
+  p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(3.3333331174e-1f));
+  __m256 t2 = _mm256_mul_ps(t, t);
+  __m256 ln = _mm256_fmadd_ps(_mm256_mul_ps(p, t), t2, t);
+  ln = _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), t2, ln);
+  return _mm256_fmadd_ps(ln, _mm256_set1_ps(1.44269504f), e);
+}
+
+__attribute__((target("avx2,fma"))) static inline __m256
+pow_ps(__m256 x, float y) {
+  return exp2_ps(_mm256_mul_ps(log2_ps(x), _mm256_set1_ps(y)));
+}
+
+// Eight pixels at a time, the gains gathered from both neighbours
+__attribute__((target("avx2,fma"))) static uint32_t
+apply_row_avx2(const float *const sdr[3], const float *const gain[3],
+               uint32_t gain_width, float gain_scale,
+               const GainMapMetadata &metadata, bool pq, float *const out[3],
+               uint32_t width) {
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 last = _mm256_set1_ps((float)(gain_width - 1));
+  const __m256i last_i = _mm256_set1_epi32((int)gain_width - 1);
+  const __m256 scale = _mm256_set1_ps(gain_scale);
+  const __m256 lanes = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f,
+                                      6.5f, 7.5f);
+  // the smallest normal float keeps log2 away from 0
+  const __m256 tiny = _mm256_set1_ps(1.17549435e-38f);
+
+  uint32_t x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m256 gx = _mm256_fmsub_ps(_mm256_add_ps(_mm256_set1_ps((float)x), lanes),
+                                scale, _mm256_set1_ps(0.5f));
+    gx = _mm256_min_ps(_mm256_max_ps(gx, zero), last);
+    __m256i i0 = _mm256_cvttps_epi32(gx);
+    __m256i i1 = _mm256_min_epi32(_mm256_add_epi32(i0, _mm256_set1_epi32(1)),
+                                  last_i);
+    __m256 f = _mm256_sub_ps(gx, _mm256_cvtepi32_ps(i0));
+
+    for (int c = 0; c < 3; c++) {
+      __m256 g0 = _mm256_i32gather_ps(gain[c], i0, 4);
+      __m256 g1 = _mm256_i32gather_ps(gain[c], i1, 4);
+      __m256 g = _mm256_fmadd_ps(_mm256_sub_ps(g1, g0), f, g0);
+
+      __m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(sdr[c] + x),
+                                             zero),
+                               one);
+      __m256 low = _mm256_mul_ps(v, _mm256_set1_ps(1 / 12.92f));
+      __m256 high = pow_ps(
+          _mm256_fmadd_ps(v, _mm256_set1_ps(1 / 1.055f),
+                          _mm256_set1_ps(0.055f / 1.055f)),
+          2.4f);
+      v = _mm256_blendv_ps(
+          high, low, _mm256_cmp_ps(v, _mm256_set1_ps(0.04045f), _CMP_LE_OQ));
+
+      v = _mm256_fmsub_ps(
+          _mm256_add_ps(v, _mm256_set1_ps(metadata.offset_sdr[c])),
+          exp2_ps(g), _mm256_set1_ps(metadata.offset_hdr[c]));
+
+      if (pq) {
+        __m256 y = pow_ps(
+            _mm256_max_ps(_mm256_mul_ps(v, _mm256_set1_ps(PQ_SDR_WHITE)),
+                          tiny),
+            PQ_M1);
+        v = pow_ps(
+            _mm256_div_ps(
+                _mm256_fmadd_ps(y, _mm256_set1_ps(PQ_C2),
+                                _mm256_set1_ps(PQ_C1)),
+                _mm256_fmadd_ps(y, _mm256_set1_ps(PQ_C3), one)),
+            PQ_M2);
+      }
+      _mm256_storeu_ps(out[c] + x, v);
+    }
+  }
+  return x;
+}
+#endif
+
+void gainmap_apply_row(const float *const sdr[3], size_t step,
+                       const float *const gain[3], uint32_t gain_width,
+                       float gain_scale, const GainMapMetadata &metadata,
+                       bool pq, float *const out[3], uint32_t width) {
+  uint32_t x = 0;
+#ifdef GAINMAP_AVX2
+  static const bool avx2 =
+      __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  if (avx2 && step == 1) {
+    x = apply_row_avx2(sdr, gain, gain_width, gain_scale, metadata, pq, out,
+                       width);
+  }
+#endif
+  apply_row_generic(sdr, step, gain, gain_width, gain_scale, metadata, pq,
+                    out, x, width);
+}
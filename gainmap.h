@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Gain map metadata of an Ultra HDR or Adobe gain map JPEG, from the hdrgm
+// XMP namespace. Gains and capacities are log2 of ratios. Values given once
+// apply to all three channels.
+struct GainMapMetadata {
+  float min[3] = {0, 0, 0};
+  float max[3] = {1, 1, 1};
+  float gamma[3] = {1, 1, 1};
+  float offset_sdr[3] = {1 / 64.f, 1 / 64.f, 1 / 64.f};
+  float offset_hdr[3] = {1 / 64.f, 1 / 64.f, 1 / 64.f};
+  float capacity_min = 0;
+  float capacity_max = 1;
+  // the base image is the HDR rendition, which the gain map takes to SDR
+  bool base_hdr = false;
+};
+
+// Reads the metadata from an XMP packet, in attributes or elements, false
+// when it has no hdrgm:GainMapMax
+bool parse_gainmap_xmp(const char *xmp, size_t size,
+                       GainMapMetadata *metadata);
+
+// Applies a row of log2 gains, at the gain map's width, to a row of sRGB
+// encoded SDR samples in 0 to 1, step samples apart. Gains are interpolated
+// linearly across the row, with gain_scale gain samples per output sample
+// and centers aligned. Writes linear samples where 1 is SDR white, or PQ
+// encoded ones with SDR white at 203 nits. The output can be the input.
+void gainmap_apply_row(const float *const sdr[3], size_t step,
+                       const float *const gain[3], uint32_t gain_width,
+                       float gain_scale, const GainMapMetadata &metadata,
+                       bool pq, float *const out[3], uint32_t width);
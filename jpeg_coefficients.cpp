@@ -0,0 +1,144 @@
+#include "jpeg_coefficients.h"
+
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+
+// An array of block rows with a window of them in memory. Arrays that fit
+// entirely have no file and a window covering every row.
+struct JpegCoefficients::Array {
+  JDIMENSION width;
+  JDIMENSION rows;
+  JDIMENSION window_rows;
+  JDIMENSION first = 0;
+  bool dirty = false;
+  std::vector<JCOEF> coefs;
+  std::vector<JBLOCKROW> pointers;
+  FILE *file = nullptr;
+
+  ~Array() {
+    if (file)
+      fclose(file);
+  }
+
+  void seek(JDIMENSION row) {
+    int64_t offset = (int64_t)row * width * sizeof(JBLOCK);
+#ifdef _WIN32
+    int rc = _fseeki64(file, offset, SEEK_SET);
+#else
+    int rc = fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+    if (rc != 0)
+      throw std::runtime_error("JPEG coefficient file: Seek failed");
+  }
+
+  // rows past the end of the file were never written and read as zeros
+  void load() {
+    size_t count = (size_t)std::min(window_rows, rows - first) * width;
+    seek(first);
+    size_t read = fread(coefs.data(), sizeof(JBLOCK), count, file);
+    if (read < count && ferror(file))
+      throw std::runtime_error("JPEG coefficient file: Read failed");
+    memset(coefs.data() + read * DCTSIZE2, 0, (count - read) * sizeof(JBLOCK));
+  }
+
+  void store() {
+    size_t count = (size_t)std::min(window_rows, rows - first) * width;
+    seek(first);
+    if (fwrite(coefs.data(), sizeof(JBLOCK), count, file) != count)
+      throw std::runtime_error("JPEG coefficient file: Write failed");
+  }
+};
+
+JpegCoefficients::JpegCoefficients(j_decompress_ptr dinfo, size_t max_memory)
+    : m_max_memory(max_memory), m_request(dinfo->mem->request_virt_barray) {
+  dinfo->client_data = this;
+  dinfo->mem->request_virt_barray = request;
+  if (max_memory > 0) {
+    // libjpeg only weighs the limit against its own virtual arrays, which
+    // are all allocated here instead
+    dinfo->mem->max_memory_to_use =
+        (long)std::min<size_t>(max_memory, LONG_MAX);
+    dinfo->mem->access_virt_barray = access;
+  }
+}
+
+JpegCoefficients::~JpegCoefficients() = default;
+
+jvirt_barray_ptr JpegCoefficients::request(j_common_ptr cinfo, int pool_id,
+                                           boolean pre_zero,
+                                           JDIMENSION blocksperrow,
+                                           JDIMENSION numrows,
+                                           JDIMENSION maxaccess) {
+  auto *self = static_cast<JpegCoefficients *>(cinfo->client_data);
+  if (!self->limited()) {
+    jvirt_barray_ptr array = self->m_request(cinfo, pool_id, pre_zero,
+                                             blocksperrow, numrows, maxaccess);
+    self->arrays.push_back(array);
+    return array;
+  }
+
+  // an array that doesn't fit gets a window of half of what is left, so the
+  // ones requested after it still get some
+  auto array = std::make_unique<Array>();
+  size_t row_bytes = (size_t)blocksperrow * sizeof(JBLOCK);
+  size_t left = self->m_max_memory > self->m_used
+                    ? self->m_max_memory - self->m_used
+                    : 0;
+  array->width = blocksperrow;
+  array->rows = numrows;
+  if (row_bytes * numrows <= left) {
+    array->window_rows = numrows;
+  } else {
+    array->window_rows = (JDIMENSION)std::min<size_t>(
+        std::max<size_t>(left / 2 / std::max<size_t>(row_bytes, 1), maxaccess),
+        numrows);
+    array->file = tmpfile();
+    if (!array->file)
+      throw std::runtime_error("JPEG coefficient file: Failed to create");
+  }
+
+  array->coefs.resize((size_t)array->window_rows * blocksperrow * DCTSIZE2);
+  array->pointers.resize(array->window_rows);
+  for (JDIMENSION i = 0; i < array->window_rows; i++) {
+    array->pointers[i] = reinterpret_cast<JBLOCKROW>(
+        array->coefs.data() + (size_t)i * blocksperrow * DCTSIZE2);
+  }
+  self->m_used += row_bytes * array->window_rows;
+
+  auto *ptr = reinterpret_cast<jvirt_barray_ptr>(array.get());
+  self->m_owned.push_back(std::move(array));
+  self->arrays.push_back(ptr);
+  return ptr;
+}
+
+JBLOCKARRAY JpegCoefficients::access(j_common_ptr, jvirt_barray_ptr ptr,
+                                     JDIMENSION start_row,
+                                     JDIMENSION num_rows, boolean writable) {
+  auto *array = reinterpret_cast<Array *>(ptr);
+  if ((uint64_t)start_row + num_rows > array->rows ||
+      num_rows > array->window_rows)
+    throw std::runtime_error("Bad JPEG coefficient access");
+
+  if (start_row < array->first ||
+      start_row + num_rows > array->first + array->window_rows) {
+    if (array->dirty)
+      array->store();
+    // moving forward starts the window at the first row asked for, moving
+    // back ends it at the last one, like libjpeg's own backing store
+    JDIMENSION first = start_row > array->first
+                           ? start_row
+                           : (start_row + num_rows > array->window_rows
+                                  ? start_row + num_rows - array->window_rows
+                                  : 0);
+    array->first = std::min(first, array->rows - array->window_rows);
+    array->load();
+    array->dirty = false;
+  }
+
+  if (writable)
+    array->dirty = true;
+  return array->pointers.data() + (start_row - array->first);
+}
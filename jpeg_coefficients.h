@@ -0,0 +1,47 @@
+#pragma once
+
+#include <memory>
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+#include "jpeglib.h"
+
+// Takes over the virtual coefficient arrays of a libjpeg decompressor. The
+// arrays are recorded as they are requested, since jpeg_read_coefficients
+// only returns them once the whole file has been read. Under a memory limit
+// the arrays are allocated here instead of by libjpeg, whose backing store
+// is usually built without temporary files. Arrays that don't fit in what is
+// left of the limit are kept in a temporary file with a window of rows in
+// memory, so decoding huge progressive JPEGs degrades to disk instead of
+// running out of memory.
+class JpegCoefficients {
+public:
+  // the hooks stay installed for the life of the decompressor, which must
+  // not outlive this
+  JpegCoefficients(j_decompress_ptr dinfo, size_t max_memory);
+  ~JpegCoefficients();
+
+  // in the order libjpeg requested them, one per component
+  std::vector<jvirt_barray_ptr> arrays;
+
+  // rows of arrays kept in a file are only valid until the next access to
+  // the same array
+  bool limited() const { return m_max_memory > 0; };
+
+private:
+  struct Array;
+
+  size_t m_max_memory;
+  size_t m_used = 0;
+  std::vector<std::unique_ptr<Array>> m_owned;
+  jvirt_barray_ptr (*m_request)(j_common_ptr, int, boolean, JDIMENSION,
+                                JDIMENSION, JDIMENSION);
+
+  static jvirt_barray_ptr request(j_common_ptr cinfo, int pool_id,
+                                  boolean pre_zero, JDIMENSION blocksperrow,
+                                  JDIMENSION numrows, JDIMENSION maxaccess);
+  static JBLOCKARRAY access(j_common_ptr cinfo, jvirt_barray_ptr ptr,
+                            JDIMENSION start_row, JDIMENSION num_rows,
+                            boolean writable);
+};
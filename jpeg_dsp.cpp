@@ -0,0 +1,556 @@
+#include "jpeg_dsp.h"
+
+#include <array>
+#include <cmath>
+
+static constexpr int CONST_BITS = 13;
+static constexpr int PASS1_BITS = 2;
+
+static constexpr int32_t FIX_0_298631336 = 2446;
+static constexpr int32_t FIX_0_390180644 = 3196;
+static constexpr int32_t FIX_0_541196100 = 4433;
+static constexpr int32_t FIX_0_765366865 = 6270;
+static constexpr int32_t FIX_0_899976223 = 7373;
+static constexpr int32_t FIX_1_175875602 = 9633;
+static constexpr int32_t FIX_1_501321110 = 12299;
+static constexpr int32_t FIX_1_847759065 = 15137;
+static constexpr int32_t FIX_1_961570560 = 16069;
+static constexpr int32_t FIX_2_053119869 = 16819;
+static constexpr int32_t FIX_2_562915447 = 20995;
+static constexpr int32_t FIX_3_072711026 = 25172;
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+
+// constant pair for _mm_madd_epi16 on 16 bit values interleaved as (a, b)
+static inline __m128i pair(int32_t a, int32_t b) {
+  return _mm_set1_epi32((int32_t)((uint16_t)a | (uint32_t)(uint16_t)b << 16));
+}
+
+// One dimensional IDCT of 8 vectors at once, in[k] holding coefficient k of
+// each lane, with 16 bit inputs as in libjpeg-turbo's SIMD IDCTs. Sums of
+// products sharing an input are folded into single pmaddwd constants, which
+// keeps the arithmetic of jpeg_idct_islow exact as long as the inputs fit in
+// 16 bits, like they do for any valid JPEG.
+template <int shift, bool last>
+static inline void idct_1d(const __m128i *in, __m128i *out) {
+  const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+  const __m128i center = _mm_set1_epi32(128);
+
+  __m128i z3 = _mm_add_epi16(in[7], in[3]);
+  __m128i z4 = _mm_add_epi16(in[5], in[1]);
+
+  __m128i lanes[2][8];
+  for (int h = 0; h < 2; h++) {
+    auto unpack = [h](__m128i a, __m128i b) {
+      return h ? _mm_unpackhi_epi16(a, b) : _mm_unpacklo_epi16(a, b);
+    };
+    __m128i p26 = unpack(in[2], in[6]);
+    __m128i p04 = unpack(in[0], in[4]);
+    __m128i p71 = unpack(in[7], in[1]);
+    __m128i p53 = unpack(in[5], in[3]);
+    __m128i pz = unpack(z3, z4);
+
+    // even part
+    __m128i tmp3 = _mm_madd_epi16(
+        p26, pair(FIX_0_541196100 + FIX_0_765366865, FIX_0_541196100));
+    __m128i tmp2 = _mm_madd_epi16(
+        p26, pair(FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065));
+    __m128i tmp0 =
+        _mm_madd_epi16(p04, pair(1 << CONST_BITS, 1 << CONST_BITS));
+    __m128i tmp1 =
+        _mm_madd_epi16(p04, pair(1 << CONST_BITS, -(1 << CONST_BITS)));
+
+    __m128i tmp10 = _mm_add_epi32(tmp0, tmp3);
+    __m128i tmp13 = _mm_sub_epi32(tmp0, tmp3);
+    __m128i tmp11 = _mm_add_epi32(tmp1, tmp2);
+    __m128i tmp12 = _mm_sub_epi32(tmp1, tmp2);
+
+    // odd part
+    __m128i z3s = _mm_madd_epi16(
+        pz, pair(FIX_1_175875602 - FIX_1_961570560, FIX_1_175875602));
+    __m128i z4s = _mm_madd_epi16(
+        pz, pair(FIX_1_175875602, FIX_1_175875602 - FIX_0_390180644));
+
+    __m128i o0 = _mm_add_epi32(
+        _mm_madd_epi16(p71, pair(FIX_0_298631336 - FIX_0_899976223,
+                                 -FIX_0_899976223)),
+        z3s);
+    __m128i o3 = _mm_add_epi32(
+        _mm_madd_epi16(p71, pair(-FIX_0_899976223,
+                                 FIX_1_501321110 - FIX_0_899976223)),
+        z4s);
+    __m128i o1 = _mm_add_epi32(
+        _mm_madd_epi16(p53, pair(FIX_2_053119869 - FIX_2_562915447,
+                                 -FIX_2_562915447)),
+        z4s);
+    __m128i o2 = _mm_add_epi32(
+        _mm_madd_epi16(p53, pair(-FIX_2_562915447,
+                                 FIX_3_072711026 - FIX_2_562915447)),
+        z3s);
+
+    __m128i *l = lanes[h];
+    l[0] = _mm_add_epi32(tmp10, o3);
+    l[7] = _mm_sub_epi32(tmp10, o3);
+    l[1] = _mm_add_epi32(tmp11, o2);
+    l[6] = _mm_sub_epi32(tmp11, o2);
+    l[2] = _mm_add_epi32(tmp12, o1);
+    l[5] = _mm_sub_epi32(tmp12, o1);
+    l[3] = _mm_add_epi32(tmp13, o0);
+    l[4] = _mm_sub_epi32(tmp13, o0);
+
+    for (int i = 0; i < 8; i++) {
+      l[i] = _mm_srai_epi32(_mm_add_epi32(l[i], round), shift);
+      if (last) {
+        // libjpeg masks results to 10 bits before range limiting, the
+        // clamping itself is left to the final packs
+        l[i] = _mm_srai_epi32(_mm_slli_epi32(l[i], 22), 22);
+        l[i] = _mm_add_epi32(l[i], center);
+      }
+    }
+  }
+
+  for (int i = 0; i < 8; i++)
+    out[i] = _mm_packs_epi32(lanes[0][i], lanes[1][i]);
+}
+
+static inline void transpose_8x8(__m128i *r) {
+  __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+  __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+  __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+  __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+  __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+  __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+  __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+  __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+  __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+  __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+  __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+  __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+  __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+  __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+  __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+  __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+  r[0] = _mm_unpacklo_epi64(b0, b4);
+  r[1] = _mm_unpackhi_epi64(b0, b4);
+  r[2] = _mm_unpacklo_epi64(b1, b5);
+  r[3] = _mm_unpackhi_epi64(b1, b5);
+  r[4] = _mm_unpacklo_epi64(b2, b6);
+  r[5] = _mm_unpackhi_epi64(b2, b6);
+  r[6] = _mm_unpacklo_epi64(b3, b7);
+  r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+void jpeg_idct_islow_8(const int16_t *coef, const uint16_t *quant,
+                       uint8_t *out, size_t stride) {
+  __m128i a[8];
+  __m128i b[8];
+
+  // dequantized with 16 bit multiplies like libjpeg-turbo's SIMD IDCTs
+  for (int i = 0; i < 8; i++) {
+    a[i] = _mm_mullo_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(coef + i * 8)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(quant + i * 8)));
+  }
+
+  // columns, keeping PASS1_BITS of extra precision
+  idct_1d<CONST_BITS - PASS1_BITS, false>(a, b);
+  transpose_8x8(b);
+  // rows, removing the extra precision and the factor of 8 of the 2D IDCT
+  idct_1d<CONST_BITS + PASS1_BITS + 3, true>(b, a);
+  transpose_8x8(a);
+
+  for (int y = 0; y < 8; y += 2) {
+    __m128i rows = _mm_packus_epi16(a[y], a[y + 1]);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out + y * stride), rows);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out + (y + 1) * stride),
+                     _mm_srli_si128(rows, 8));
+  }
+}
+#else
+// libjpeg masks IDCT results to 10 bits before range limiting, so values far
+// outside of the sample range wrap the same way here
+static inline uint8_t range_limit(int32_t x) {
+  x &= 1023;
+  if (x >= 512)
+    x -= 1024;
+  x += 128;
+  return x < 0 ? 0 : x > 255 ? 255 : (uint8_t)x;
+}
+
+// One dimensional IDCT of 8 vectors at once, in[k * 8 + i] holding
+// coefficient k of vector i. libjpeg skips the work for vectors without AC
+// coefficients, which gives the same results as the full computation, so
+// the loops here stay branch free and vectorize.
+template <int in_shift, int out_shift>
+static inline void idct_1d(const int32_t *in, int32_t *out) {
+  for (int i = 0; i < 8; i++) {
+    int32_t z2 = in[16 + i];
+    int32_t z3 = in[48 + i];
+    int32_t z1 = (z2 + z3) * FIX_0_541196100;
+    int32_t tmp2 = z1 + z3 * -FIX_1_847759065;
+    int32_t tmp3 = z1 + z2 * FIX_0_765366865;
+
+    z2 = in[i];
+    z3 = in[32 + i];
+    int32_t tmp0 = (z2 + z3) * (1 << CONST_BITS);
+    int32_t tmp1 = (z2 - z3) * (1 << CONST_BITS);
+
+    int32_t tmp10 = tmp0 + tmp3;
+    int32_t tmp13 = tmp0 - tmp3;
+    int32_t tmp11 = tmp1 + tmp2;
+    int32_t tmp12 = tmp1 - tmp2;
+
+    tmp0 = in[56 + i];
+    tmp1 = in[40 + i];
+    tmp2 = in[24 + i];
+    tmp3 = in[8 + i];
+
+    z1 = tmp0 + tmp3;
+    z2 = tmp1 + tmp2;
+    z3 = tmp0 + tmp2;
+    int32_t z4 = tmp1 + tmp3;
+    int32_t z5 = (z3 + z4) * FIX_1_175875602;
+
+    tmp0 = tmp0 * FIX_0_298631336;
+    tmp1 = tmp1 * FIX_2_053119869;
+    tmp2 = tmp2 * FIX_3_072711026;
+    tmp3 = tmp3 * FIX_1_501321110;
+    z1 = z1 * -FIX_0_899976223;
+    z2 = z2 * -FIX_2_562915447;
+    z3 = z3 * -FIX_1_961570560 + z5;
+    z4 = z4 * -FIX_0_390180644 + z5;
+
+    tmp0 += z1 + z3;
+    tmp1 += z2 + z4;
+    tmp2 += z2 + z3;
+    tmp3 += z1 + z4;
+
+    constexpr int32_t round = 1 << (out_shift - 1);
+    out[i] = (tmp10 + tmp3 + round) >> out_shift;
+    out[56 + i] = (tmp10 - tmp3 + round) >> out_shift;
+    out[8 + i] = (tmp11 + tmp2 + round) >> out_shift;
+    out[48 + i] = (tmp11 - tmp2 + round) >> out_shift;
+    out[16 + i] = (tmp12 + tmp1 + round) >> out_shift;
+    out[40 + i] = (tmp12 - tmp1 + round) >> out_shift;
+    out[24 + i] = (tmp13 + tmp0 + round) >> out_shift;
+    out[32 + i] = (tmp13 - tmp0 + round) >> out_shift;
+  }
+}
+
+static inline void transpose_8x8(const int32_t *in, int32_t *out) {
+  for (int y = 0; y < 8; y++) {
+    for (int x = 0; x < 8; x++)
+      out[x * 8 + y] = in[y * 8 + x];
+  }
+}
+
+void jpeg_idct_islow_8(const int16_t *coef, const uint16_t *quant,
+                       uint8_t *out, size_t stride) {
+  int32_t a[64];
+  int32_t b[64];
+
+  for (int i = 0; i < 64; i++)
+    a[i] = coef[i] * quant[i];
+
+  // columns, keeping PASS1_BITS of extra precision
+  idct_1d<0, CONST_BITS - PASS1_BITS>(a, b);
+  transpose_8x8(b, a);
+  // rows, removing the extra precision and the factor of 8 of the 2D IDCT
+  idct_1d<0, CONST_BITS + PASS1_BITS + 3>(a, b);
+
+  for (int y = 0; y < 8; y++) {
+    for (int x = 0; x < 8; x++)
+      out[y * stride + x] = range_limit(b[x * 8 + y]);
+  }
+}
+#endif
+
+static constexpr double PI = 3.14159265358979323846;
+
+// m[y * 8 + k] is the weight of coefficient k in sample y of a one
+// dimensional IDCT, including the normalization of the 2D transform
+static const float *idct_matrix() {
+  static const auto matrix = [] {
+    std::array<float, 64> m;
+    for (int y = 0; y < 8; y++) {
+      for (int k = 0; k < 8; k++) {
+        double c = k == 0 ? std::sqrt(0.5) : 1.0;
+        m[y * 8 + k] =
+            (float)(c / 2 * std::cos((2 * y + 1) * k * PI / 16));
+      }
+    }
+    return m;
+  }();
+  return matrix.data();
+}
+
+static void idct_float_generic(const int16_t *coef, const uint16_t *quant,
+                               float *out) {
+  const float *m = idct_matrix();
+  float a[64];
+  float t[64];
+
+  for (int i = 0; i < 64; i++)
+    a[i] = (float)(coef[i] * quant[i]);
+
+  for (int y = 0; y < 8; y++) {
+    for (int u = 0; u < 8; u++) {
+      float sum = 0;
+      for (int k = 0; k < 8; k++)
+        sum += m[y * 8 + k] * a[k * 8 + u];
+      t[y * 8 + u] = sum;
+    }
+  }
+
+  for (int y = 0; y < 8; y++) {
+    for (int x = 0; x < 8; x++) {
+      float sum = 128;
+      for (int u = 0; u < 8; u++)
+        sum += m[x * 8 + u] * t[y * 8 + u];
+      out[y * 8 + x] = sum;
+    }
+  }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JPEG_DSP_AVX2
+#include <immintrin.h>
+
+__attribute__((target("avx2,fma"))) static inline void
+transpose_8x8_ps(__m256 *r) {
+  __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+  __m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+  __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+  __m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+  __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+  __m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+  __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+  __m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+
+  __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+  __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+  __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+  __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+  __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+  __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+  __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+  __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+  r[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+  r[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+  r[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+  r[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+  r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+  r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+  r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+  r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+// Both passes as 8x8 matrix products with a vector of 8 lanes per row
+__attribute__((target("avx2,fma"))) static void
+idct_float_avx2(const int16_t *coef, const uint16_t *quant, float *out) {
+  const float *m = idct_matrix();
+  __m256 a[8];
+  __m256 t[8];
+
+  for (int k = 0; k < 8; k++) {
+    __m256 c = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(coef + k * 8))));
+    __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(quant + k * 8))));
+    a[k] = _mm256_mul_ps(c, q);
+  }
+
+  for (int y = 0; y < 8; y++) {
+    __m256 sum = _mm256_mul_ps(_mm256_broadcast_ss(m + y * 8), a[0]);
+    for (int k = 1; k < 8; k++)
+      sum = _mm256_fmadd_ps(_mm256_broadcast_ss(m + y * 8 + k), a[k], sum);
+    t[y] = sum;
+  }
+  transpose_8x8_ps(t);
+
+  for (int x = 0; x < 8; x++) {
+    __m256 sum = _mm256_set1_ps(128);
+    for (int u = 0; u < 8; u++)
+      sum = _mm256_fmadd_ps(_mm256_broadcast_ss(m + x * 8 + u), t[u], sum);
+    a[x] = sum;
+  }
+  transpose_8x8_ps(a);
+
+  for (int y = 0; y < 8; y++)
+    _mm256_storeu_ps(out + y * 8, a[y]);
+}
+#endif
+
+void jpeg_idct_float_8(const int16_t *coef, const uint16_t *quant,
+                       float *out) {
+#ifdef JPEG_DSP_AVX2
+  static const bool avx2 =
+      __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  if (avx2) {
+    idct_float_avx2(coef, quant, out);
+    return;
+  }
+#endif
+  idct_float_generic(coef, quant, out);
+}
+
+// Sums of the nearest and next nearest input rows and the rounding of the
+// horizontal pass follow libjpeg's h2v1, h1v2 and h2v2 fancy upsamplers,
+// which treat the samples past both ends of a row as copies of the edge.
+void jpeg_fancy_upsample_row_8(const uint8_t *near, const uint8_t *far,
+                               uint32_t width, bool h2, bool v2, bool lower,
+                               int16_t *sums, uint8_t *out) {
+  if (!h2) {
+    int bias = lower ? 2 : 1;
+    for (uint32_t x = 0; x < width; x++)
+      out[x] = (uint8_t)((near[x] * 3 + far[x] + bias) >> 2);
+    return;
+  }
+
+  // vertical pass on a scale of 4 so both cases share the horizontal pass
+  int16_t *s = sums + 1;
+  if (v2) {
+    for (uint32_t x = 0; x < width; x++)
+      s[x] = (int16_t)(near[x] * 3 + far[x]);
+  } else {
+    for (uint32_t x = 0; x < width; x++)
+      s[x] = (int16_t)(near[x] * 4);
+  }
+  s[-1] = s[0];
+  s[width] = s[width - 1];
+
+  const int16_t *left = s - 1;
+  const int16_t *right = s + 1;
+  int16_t even_bias = v2 ? 8 : 4;
+  int16_t odd_bias = v2 ? 7 : 8;
+  uint32_t x = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  const __m128i eb = _mm_set1_epi16(even_bias);
+  const __m128i ob = _mm_set1_epi16(odd_bias);
+  for (; x + 8 <= width; x += 8) {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + x));
+    __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i *>(left + x));
+    __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i *>(right + x));
+    __m128i c3 = _mm_add_epi16(c, _mm_add_epi16(c, c));
+    __m128i even =
+        _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(c3, l), eb), 4);
+    __m128i odd = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(c3, r), ob), 4);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x * 2),
+                     _mm_packus_epi16(_mm_unpacklo_epi16(even, odd),
+                                      _mm_unpackhi_epi16(even, odd)));
+  }
+#endif
+  for (; x < width; x++) {
+    out[x * 2] = (uint8_t)((s[x] * 3 + left[x] + even_bias) >> 4);
+    out[x * 2 + 1] = (uint8_t)((s[x] * 3 + right[x] + odd_bias) >> 4);
+  }
+}
+
+void jpeg_fancy_upsample_row_float(const float *near, const float *far,
+                                   uint32_t width, bool h2, bool v2,
+                                   float *sums, float *out) {
+  float *s = h2 ? sums + 1 : out;
+  if (v2) {
+    for (uint32_t x = 0; x < width; x++)
+      s[x] = near[x] * 0.75f + far[x] * 0.25f;
+  } else {
+    for (uint32_t x = 0; x < width; x++)
+      s[x] = near[x];
+  }
+  if (!h2)
+    return;
+
+  s[-1] = s[0];
+  s[width] = s[width - 1];
+  const float *left = s - 1;
+  const float *right = s + 1;
+  for (uint32_t x = 0; x < width; x++) {
+    out[x * 2] = s[x] * 0.75f + left[x] * 0.25f;
+    out[x * 2 + 1] = s[x] * 0.75f + right[x] * 0.25f;
+  }
+}
+
+static constexpr int SCALEBITS = 16;
+static constexpr int32_t ONE_HALF = 1 << (SCALEBITS - 1);
+static constexpr int32_t FIX_0_34414 = 22554;
+static constexpr int32_t FIX_0_71414 = 46802;
+static constexpr int32_t FIX_1_40200 = 91881;
+static constexpr int32_t FIX_1_77200 = 116130;
+
+static inline uint8_t clamp_8(int32_t x) {
+  return x < 0 ? 0 : x > 255 ? 255 : (uint8_t)x;
+}
+
+void jpeg_ycc_rgb_8(const uint8_t *y, const uint8_t *cb, const uint8_t *cr,
+                    uint8_t *r, uint8_t *g, uint8_t *b, uint32_t width) {
+  uint32_t x = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  // the constants above 1 are split into a multiple of 1 << SCALEBITS,
+  // added after the shift, and a remainder that fits pmaddwd
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i center = _mm_set1_epi16(128);
+  const __m128i two = _mm_set1_epi16(2);
+  const __m128i half = _mm_set1_epi32(ONE_HALF);
+  const __m128i k_r = pair(FIX_1_40200 - (1 << SCALEBITS), ONE_HALF / 2);
+  const __m128i k_b = pair(FIX_1_77200 - (2 << SCALEBITS), ONE_HALF / 2);
+  const __m128i k_g = pair(-FIX_0_34414, (1 << SCALEBITS) - FIX_0_71414);
+
+  auto madd = [&](__m128i a, __m128i b, __m128i k, __m128i add) {
+    __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), k),
+                               add);
+    __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), k),
+                               add);
+    return _mm_packs_epi32(_mm_srai_epi32(lo, SCALEBITS),
+                           _mm_srai_epi32(hi, SCALEBITS));
+  };
+
+  for (; x + 8 <= width; x += 8) {
+    __m128i yv = _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(y + x)), zero);
+    __m128i cbv = _mm_sub_epi16(
+        _mm_unpacklo_epi8(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i *>(cb + x)), zero),
+        center);
+    __m128i crv = _mm_sub_epi16(
+        _mm_unpacklo_epi8(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i *>(cr + x)), zero),
+        center);
+
+    __m128i rv = _mm_add_epi16(_mm_add_epi16(yv, crv),
+                               madd(crv, two, k_r, zero));
+    __m128i gv = _mm_sub_epi16(_mm_add_epi16(yv, madd(cbv, crv, k_g, half)),
+                               crv);
+    __m128i bv = _mm_add_epi16(_mm_add_epi16(yv, _mm_add_epi16(cbv, cbv)),
+                               madd(cbv, two, k_b, zero));
+
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(r + x),
+                     _mm_packus_epi16(rv, zero));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(g + x),
+                     _mm_packus_epi16(gv, zero));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(b + x),
+                     _mm_packus_epi16(bv, zero));
+  }
+#endif
+  for (; x < width; x++) {
+    int32_t cbx = cb[x] - 128;
+    int32_t crx = cr[x] - 128;
+    r[x] = clamp_8(y[x] + ((FIX_1_40200 * crx + ONE_HALF) >> SCALEBITS));
+    g[x] = clamp_8(
+        y[x] + ((-FIX_0_34414 * cbx - FIX_0_71414 * crx + ONE_HALF) >>
+                SCALEBITS));
+    b[x] = clamp_8(y[x] + ((FIX_1_77200 * cbx + ONE_HALF) >> SCALEBITS));
+  }
+}
+
+void jpeg_ycc_rgb_float(const float *y, const float *cb, const float *cr,
+                        float *r, float *g, float *b, uint32_t width) {
+  for (uint32_t x = 0; x < width; x++) {
+    r[x] = y[x] + 1.402f * cr[x];
+    g[x] = y[x] - 0.344136f * cb[x] - 0.714136f * cr[x];
+    b[x] = y[x] + 1.772f * cb[x];
+  }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Port of libjpeg's accurate integer IDCT (jpeg_idct_islow). Dequantizes an
+// 8x8 block of coefficients in natural order and writes samples that match
+// libjpeg's JDCT_ISLOW output exactly.
+void jpeg_idct_islow_8(const int16_t *coef, const uint16_t *quant,
+                       uint8_t *out, size_t stride);
+
+// Floating point IDCT of an 8x8 block of coefficients in natural order.
+// Writes 64 unclamped samples on libjpeg's 8 bit scale, level shift
+// included, without rounding them to integers.
+void jpeg_idct_float_8(const int16_t *coef, const uint16_t *quant,
+                       float *out);
+
+// Upsamples one row of a component by 2 horizontally (h2), vertically (v2)
+// or both with libjpeg's fancy triangle filter, matching its output exactly.
+// near is the closest input row and far the next closest one, above it for
+// the upper and below it for the lower output row of a pair. sums holds
+// width + 2 values. Writes width samples, or 2 * width with h2.
+void jpeg_fancy_upsample_row_8(const uint8_t *near, const uint8_t *far,
+                               uint32_t width, bool h2, bool v2, bool lower,
+                               int16_t *sums, uint8_t *out);
+void jpeg_fancy_upsample_row_float(const float *near, const float *far,
+                                   uint32_t width, bool h2, bool v2,
+                                   float *sums, float *out);
+
+// Nearest neighbour upsampling of a row by an integer factor
+template <typename T>
+void jpeg_upsample_row(const T *in, uint32_t width, uint32_t h_expand,
+                       T *out) {
+  if (h_expand == 2) {
+    for (uint32_t x = 0; x < width; x++) {
+      out[x * 2] = in[x];
+      out[x * 2 + 1] = in[x];
+    }
+    return;
+  }
+  for (uint32_t x = 0; x < width; x++) {
+    for (uint32_t i = 0; i < h_expand; i++)
+      out[x * h_expand + i] = in[x];
+  }
+}
+
+// JFIF YCbCr to RGB. The 8 bit version matches libjpeg's fixed point
+// conversion exactly, the float one takes full range samples with chroma
+// centered at 0 and leaves the results unclamped.
+void jpeg_ycc_rgb_8(const uint8_t *y, const uint8_t *cb, const uint8_t *cr,
+                    uint8_t *r, uint8_t *g, uint8_t *b, uint32_t width);
+void jpeg_ycc_rgb_float(const float *y, const float *cb, const float *cr,
+                        float *r, float *g, float *b, uint32_t width);
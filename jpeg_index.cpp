@@ -0,0 +1,690 @@
+#include "jpeg_index.h"
+#include "content_hash.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string.h>
+#include <thread>
+
+static constexpr char INDEX_MAGIC[8] = {'C', 'S', 'J', 'P', 'G', 'I', 'D', 'X'};
+static constexpr uint32_t INDEX_VERSION = 3;
+
+// Extracted JPEGs use fixed length codes covering every symbol a baseline
+// 8 bit scan can contain, so re-encoded DC differences always have a code
+static constexpr uint32_t DC_CODE_LENGTH = 5;
+static constexpr uint32_t DC_SYMBOLS = 16;
+static constexpr uint32_t AC_CODE_LENGTH = 8;
+
+static uint16_t read_be16(const uint8_t *p) {
+  return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static void build_huff_table(JpegIndex::HuffTable &table, const uint8_t *bits,
+                             const uint8_t *vals, uint32_t count) {
+  // the codes of each length have to fit in its bits without the all ones
+  // code, as libjpeg checks, before any of them are written to the lookup
+  int32_t code = 0;
+  for (int l = 1; l <= 16; l++) {
+    code += bits[l - 1];
+    if (code >= (1 << l))
+      throw std::runtime_error("jpeg_index: Bad huffman table");
+    code <<= 1;
+  }
+
+  memset(table.lookup_len, 0, sizeof(table.lookup_len));
+  memset(table.code_len, 0, sizeof(table.code_len));
+  memcpy(table.vals, vals, count);
+
+  code = 0;
+  int32_t k = 0;
+  for (int l = 1; l <= 16; l++) {
+    table.valptr[l] = k;
+    table.mincode[l] = code;
+    for (int i = 0; i < bits[l - 1]; i++, k++, code++) {
+      table.codes[vals[k]] = (uint16_t)code;
+      table.code_len[vals[k]] = l;
+      if (l <= 9) {
+        int shift = 9 - l;
+        for (int j = 0; j < (1 << shift); j++) {
+          table.lookup_len[(code << shift) | j] = l;
+          table.lookup_sym[(code << shift) | j] = vals[k];
+        }
+      }
+    }
+    table.maxcode[l] = bits[l - 1] ? code - 1 : -1;
+    code <<= 1;
+  }
+  table.maxcode[17] = INT32_MAX;
+  table.defined = true;
+}
+
+namespace {
+class BitReader {
+private:
+  const uint8_t *m_data;
+  size_t m_size;
+
+public:
+  uint64_t pos;
+  uint64_t bits = 0;
+  uint32_t bit_count = 0;
+  uint32_t marker = 0;
+  uint64_t consumed = 0;
+
+  BitReader(const uint8_t *data, size_t size, size_t pos)
+      : m_data(data), m_size(size), pos(pos) {}
+
+  // loads whole bytes until more than 56 bits are buffered, a marker or the
+  // end of the data pads the stream with zeros like libjpeg does
+  void fill() {
+    while (bit_count <= 56) {
+      uint64_t byte = 0;
+      if (!marker && pos < m_size) {
+        byte = m_data[pos];
+        if (byte == 0xFF) {
+          if (pos + 1 < m_size && m_data[pos + 1] == 0) {
+            pos += 2;
+          } else {
+            marker = 1;
+            byte = 0;
+          }
+        } else {
+          pos++;
+        }
+      }
+      bits |= byte << (56 - bit_count);
+      bit_count += 8;
+    }
+  }
+
+  uint32_t peek(uint32_t n) { return (uint32_t)(bits >> (64 - n)); }
+
+  void skip(uint32_t n) {
+    bits <<= n;
+    bit_count -= n;
+    consumed += n;
+  }
+
+  uint32_t get(uint32_t n) {
+    if (n == 0)
+      return 0;
+    if (bit_count < n)
+      fill();
+    uint32_t v = peek(n);
+    skip(n);
+    return v;
+  }
+
+  int decode(const JpegIndex::HuffTable &table) {
+    if (bit_count < 16)
+      fill();
+
+    uint32_t look = peek(9);
+    if (table.lookup_len[look]) {
+      uint8_t sym = table.lookup_sym[look];
+      skip(table.lookup_len[look]);
+      return sym;
+    }
+
+    for (int l = 10; l <= 16; l++) {
+      int32_t code = peek(l);
+      if (code <= table.maxcode[l]) {
+        skip(l);
+        return table.vals[table.valptr[l] + code - table.mincode[l]];
+      }
+    }
+
+    throw std::runtime_error("jpeg_index: Corrupt huffman data");
+  }
+
+  void restart() {
+    bits = 0;
+    bit_count = 0;
+    marker = 0;
+    while (pos + 1 < m_size &&
+           !(m_data[pos] == 0xFF && m_data[pos + 1] >= 0xD0 &&
+             m_data[pos + 1] <= 0xD7)) {
+      pos++;
+    }
+    pos += 2;
+  }
+};
+
+class BitWriter {
+private:
+  std::vector<uint8_t> &m_out;
+  uint64_t m_bits = 0;
+  uint32_t m_count = 0;
+
+public:
+  BitWriter(std::vector<uint8_t> &out) : m_out(out) {}
+
+  void put(uint32_t v, uint32_t n) {
+    m_bits = (m_bits << n) | (v & ((1u << n) - 1));
+    m_count += n;
+    while (m_count >= 8) {
+      uint8_t byte = (uint8_t)(m_bits >> (m_count - 8));
+      m_out.push_back(byte);
+      if (byte == 0xFF)
+        m_out.push_back(0);
+      m_count -= 8;
+    }
+  }
+
+  void flush() {
+    if (m_count > 0)
+      put(0x7F, 8 - m_count);
+  }
+};
+} // namespace
+
+// AC symbols of 8 bit baseline scans, in the order of their codes in
+// extracted JPEGs
+static const std::vector<uint8_t> &ac_symbols() {
+  static const std::vector<uint8_t> symbols = [] {
+    std::vector<uint8_t> s = {0x00, 0xF0};
+    for (int r = 0; r < 16; r++) {
+      for (int size = 1; size <= 10; size++) {
+        s.push_back((uint8_t)(r << 4 | size));
+      }
+    }
+    return s;
+  }();
+  return symbols;
+}
+
+// Code of each AC symbol, 0xFF marks symbols outside of ac_symbols
+static const uint8_t *ac_codes() {
+  static const auto codes = [] {
+    std::vector<uint8_t> c(256, 0xFF);
+    auto &symbols = ac_symbols();
+    for (size_t i = 0; i < symbols.size(); i++) {
+      c[symbols[i]] = (uint8_t)i;
+    }
+    return c;
+  }();
+  return codes.data();
+}
+
+static uint32_t bit_length(uint32_t v) {
+  uint32_t n = 0;
+  while (v) {
+    n++;
+    v >>= 1;
+  }
+  return n;
+}
+
+namespace {
+// Destination of re-encoded MCUs. Null tables select the fixed length codes,
+// otherwise symbols keep their codes from the tables of the source JPEG.
+struct Encoder {
+  BitWriter writer;
+  const JpegIndex::HuffTable *dc = nullptr;
+  const JpegIndex::HuffTable *ac = nullptr;
+  int32_t pred[4] = {};
+
+  Encoder(std::vector<uint8_t> &out) : writer(out) {}
+};
+} // namespace
+
+// Decodes one MCU, re-encoding it if encoder is set. The DC difference of
+// each block is recomputed against the encoder's predictors since the
+// extracted JPEG starts with zero predictors and has no restart markers.
+static void decode_mcu(BitReader &reader, JpegIndexPoint &state,
+                       const std::vector<uint8_t> &blocks,
+                       const std::vector<JpegIndex::Component> &components,
+                       const JpegIndex::HuffTable *dc,
+                       const JpegIndex::HuffTable *ac,
+                       uint32_t restart_interval, Encoder *encoder) {
+  if (restart_interval) {
+    if (state.restarts_left == 0) {
+      reader.restart();
+      memset(state.dc_pred, 0, sizeof(state.dc_pred));
+      state.restarts_left = restart_interval;
+    }
+    state.restarts_left--;
+  }
+
+  const uint8_t *codes = ac_codes();
+
+  for (uint8_t c : blocks) {
+    const JpegIndex::Component &comp = components[c];
+
+    int s = reader.decode(dc[comp.dc]);
+    int32_t diff = 0;
+    if (s) {
+      diff = reader.get(s);
+      if (diff < (1 << (s - 1)))
+        diff -= (1 << s) - 1;
+    }
+    state.dc_pred[c] += diff;
+
+    if (encoder) {
+      BitWriter &writer = encoder->writer;
+      int32_t new_diff = state.dc_pred[c] - encoder->pred[c];
+      encoder->pred[c] = state.dc_pred[c];
+
+      uint32_t size = bit_length(std::abs(new_diff));
+      if (encoder->dc) {
+        const JpegIndex::HuffTable &table = encoder->dc[comp.dc];
+        if (size > 255 || !table.code_len[size])
+          throw std::runtime_error("jpeg_index: DC difference has no code");
+        writer.put(table.codes[size], table.code_len[size]);
+      } else {
+        if (size >= DC_SYMBOLS)
+          throw std::runtime_error("jpeg_index: DC difference out of range");
+        writer.put(size, DC_CODE_LENGTH);
+      }
+      if (size)
+        writer.put(new_diff < 0 ? new_diff - 1 : new_diff, size);
+    }
+
+    for (int k = 1; k < 64; k++) {
+      int rs = reader.decode(ac[comp.ac]);
+      int r = rs >> 4;
+      s = rs & 15;
+
+      if (encoder) {
+        if (encoder->ac) {
+          const JpegIndex::HuffTable &table = encoder->ac[comp.ac];
+          encoder->writer.put(table.codes[rs], table.code_len[rs]);
+        } else {
+          if (codes[rs] == 0xFF)
+            throw std::runtime_error("jpeg_index: AC symbol out of range");
+          encoder->writer.put(codes[rs], AC_CODE_LENGTH);
+        }
+      }
+
+      if (s) {
+        k += r;
+        uint32_t v = reader.get(s);
+        if (encoder)
+          encoder->writer.put(v, s);
+      } else if (r == 15) {
+        k += 15;
+      } else {
+        break;
+      }
+    }
+  }
+}
+
+JpegIndex::JpegIndex(const std::vector<uint8_t> &data, uint32_t spacing,
+                     const std::string &path)
+    : m_hash(content_hash(data)),
+      m_spacing(std::max<uint32_t>(spacing, 1)) {
+  parse(data);
+
+  if (!path.empty() && load(path, data.size()))
+    return;
+
+  build(data);
+
+  if (!path.empty())
+    save(path, data.size());
+}
+
+void JpegIndex::parse(const std::vector<uint8_t> &data) {
+  size_t pos = 2;
+  bool have_frame = false;
+
+  while (true) {
+    while (pos < data.size() && data[pos] == 0xFF)
+      pos++;
+    if (pos + 3 > data.size())
+      throw std::runtime_error("jpeg_index: Missing SOS");
+
+    uint8_t marker = data[pos];
+    size_t length = read_be16(data.data() + pos + 1);
+    size_t segment = pos + 3;
+    if (length < 2 || pos + 1 + length > data.size())
+      throw std::runtime_error("jpeg_index: Truncated segment");
+    const uint8_t *p = data.data() + segment;
+    size_t payload = length - 2;
+
+    if (marker == 0xC0 || marker == 0xC1) {
+      m_sof = marker;
+      if (have_frame || payload < 6)
+        throw std::runtime_error("jpeg_index: Bad SOF");
+      if (p[0] != 8)
+        throw std::runtime_error("jpeg_index: Only 8 bit JPEGs are supported");
+      m_height = read_be16(p + 1);
+      m_width = read_be16(p + 3);
+      uint32_t count = p[5];
+      if (count == 0 || count > 4 || payload < 6 + count * 3)
+        throw std::runtime_error("jpeg_index: Bad SOF");
+      for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *c = p + 6 + i * 3;
+        if ((c[1] >> 4) < 1 || (c[1] >> 4) > 4 || (c[1] & 15) < 1 ||
+            (c[1] & 15) > 4)
+          throw std::runtime_error("jpeg_index: Bad SOF");
+        m_components.push_back({.id = c[0],
+                                .h = (uint8_t)(c[1] >> 4),
+                                .v = (uint8_t)(c[1] & 15),
+                                .tq = c[2],
+                                .dc = 0,
+                                .ac = 0});
+      }
+      have_frame = true;
+    } else if ((marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 &&
+                marker != 0xC8 && marker != 0xCC)) {
+      throw std::runtime_error("jpeg_index: Only sequential huffman JPEGs "
+                               "are supported");
+    } else if (marker == 0xC4) {
+      for (size_t i = 0; i + 17 <= payload;) {
+        uint8_t tc = p[i] >> 4;
+        uint8_t th = p[i] & 15;
+        const uint8_t *bits = p + i + 1;
+        uint32_t count = 0;
+        for (int l = 0; l < 16; l++)
+          count += bits[l];
+        if (tc > 1 || th > 3 || count > 256 || i + 17 + count > payload)
+          throw std::runtime_error("jpeg_index: Bad DHT");
+        // DC symbols are bit counts of differences, at most 15 bits
+        if (tc == 0 && std::any_of(p + i + 17, p + i + 17 + count,
+                                   [](uint8_t s) { return s > 15; }))
+          throw std::runtime_error("jpeg_index: Bad DHT");
+        build_huff_table(tc ? m_ac[th] : m_dc[th], bits, p + i + 17, count);
+        i += 17 + count;
+      }
+      m_tables.emplace_back(pos - 1, length + 2);
+    } else if (marker == 0xDD) {
+      if (payload < 2)
+        throw std::runtime_error("jpeg_index: Bad DRI");
+      m_restart_interval = read_be16(p);
+    } else if (marker == 0xDB || marker == 0xE0 || marker == 0xEE) {
+      // quantization tables, JFIF and Adobe decide how libjpeg reads the
+      // extracted image
+      m_segments.emplace_back(pos - 1, length + 2);
+    } else if (marker == 0xDA) {
+      if (!have_frame)
+        throw std::runtime_error("jpeg_index: SOS before SOF");
+      if (payload < 1 || payload < 1 + (size_t)p[0] * 2 + 3)
+        throw std::runtime_error("jpeg_index: Bad SOS");
+      uint32_t count = p[0];
+      if (count != m_components.size())
+        throw std::runtime_error("jpeg_index: Only single scan JPEGs are "
+                                 "supported");
+      for (uint32_t i = 0; i < count; i++) {
+        auto it = std::find_if(
+            m_components.begin(), m_components.end(),
+            [&](const Component &c) { return c.id == p[1 + i * 2]; });
+        if (it == m_components.end())
+          throw std::runtime_error("jpeg_index: Bad SOS");
+        it->dc = p[2 + i * 2] >> 4;
+        it->ac = p[2 + i * 2] & 15;
+        if (it->dc > 3 || it->ac > 3 || !m_dc[it->dc].defined ||
+            !m_ac[it->ac].defined)
+          throw std::runtime_error("jpeg_index: Missing huffman table");
+      }
+      m_scan_start = pos + 1 + length;
+      break;
+    }
+
+    pos += 1 + length;
+  }
+
+  uint32_t hmax = 1;
+  uint32_t vmax = 1;
+  for (auto &c : m_components) {
+    hmax = std::max<uint32_t>(hmax, c.h);
+    vmax = std::max<uint32_t>(vmax, c.v);
+  }
+
+  if (m_components.size() == 1) {
+    // non-interleaved, every MCU is a single block of the component
+    auto &c = m_components[0];
+    uint32_t cw = (m_width * c.h + hmax - 1) / hmax;
+    uint32_t ch = (m_height * c.v + vmax - 1) / vmax;
+    m_mcus_per_row = (cw + 7) / 8;
+    m_mcu_rows = (ch + 7) / 8;
+    m_mcu_height = 8 * vmax / c.v;
+    m_mcu_blocks = {0};
+  } else {
+    m_mcus_per_row = (m_width + 8 * hmax - 1) / (8 * hmax);
+    m_mcu_rows = (m_height + 8 * vmax - 1) / (8 * vmax);
+    m_mcu_height = 8 * vmax;
+    for (uint8_t i = 0; i < m_components.size(); i++) {
+      for (int b = 0; b < m_components[i].h * m_components[i].v; b++)
+        m_mcu_blocks.push_back(i);
+    }
+  }
+}
+
+void JpegIndex::build(const std::vector<uint8_t> &data) {
+  BitReader reader(data.data(), data.size(), m_scan_start);
+  JpegIndexPoint state = {};
+  state.restarts_left = m_restart_interval;
+
+  for (uint32_t row = 0; row < m_mcu_rows; row++) {
+    if (row % m_spacing == 0) {
+      state.pos = reader.pos;
+      state.bits = reader.bits;
+      state.bit_count = reader.bit_count;
+      state.marker = reader.marker;
+      state.consumed = reader.consumed;
+      m_points.push_back(state);
+    }
+
+    for (uint32_t x = 0; x < m_mcus_per_row; x++) {
+      decode_mcu(reader, state, m_mcu_blocks, m_components, m_dc, m_ac,
+                 m_restart_interval, nullptr);
+    }
+  }
+}
+
+std::vector<uint8_t> JpegIndex::extract(const std::vector<uint8_t> &data,
+                                        uint32_t first, uint32_t count) const {
+  if (first >= m_mcu_rows || count == 0)
+    throw std::runtime_error("jpeg_index: MCU rows out of range");
+  count = std::min(count, m_mcu_rows - first);
+
+  // positions a reader at the start of an MCU row, or the end of the scan
+  auto seek = [&](BitReader &reader, JpegIndexPoint &state, uint32_t row) {
+    uint32_t point = std::min<uint32_t>(row / m_spacing, m_points.size() - 1);
+    state = m_points[point];
+    reader.pos = state.pos;
+    reader.bits = state.bits;
+    reader.bit_count = state.bit_count;
+    reader.marker = state.marker;
+    reader.consumed = state.consumed;
+
+    for (uint32_t r = point * m_spacing; r < row; r++) {
+      for (uint32_t x = 0; x < m_mcus_per_row; x++) {
+        decode_mcu(reader, state, m_mcu_blocks, m_components, m_dc, m_ac,
+                   m_restart_interval, nullptr);
+      }
+    }
+  };
+
+  auto write_header = [&](std::vector<uint8_t> &out, bool source_tables) {
+    out = {0xFF, 0xD8};
+
+    for (auto [offset, length] : m_segments) {
+      out.insert(out.end(), data.begin() + offset,
+                 data.begin() + offset + length);
+    }
+
+    uint32_t height =
+        std::min(count * m_mcu_height, m_height - first * m_mcu_height);
+    size_t sof_length = 8 + m_components.size() * 3;
+    out.insert(out.end(), {0xFF, m_sof, (uint8_t)(sof_length >> 8),
+                           (uint8_t)sof_length, 8, (uint8_t)(height >> 8),
+                           (uint8_t)height, (uint8_t)(m_width >> 8),
+                           (uint8_t)m_width, (uint8_t)m_components.size()});
+    for (auto &c : m_components) {
+      out.insert(out.end(), {c.id, (uint8_t)(c.h << 4 | c.v), c.tq});
+    }
+
+    if (source_tables) {
+      for (auto [offset, length] : m_tables) {
+        out.insert(out.end(), data.begin() + offset,
+                   data.begin() + offset + length);
+      }
+    } else {
+      auto &symbols = ac_symbols();
+      size_t dht_length = 2 + 17 + DC_SYMBOLS + 17 + symbols.size();
+      out.insert(out.end(), {0xFF, 0xC4, (uint8_t)(dht_length >> 8),
+                             (uint8_t)dht_length});
+      out.push_back(0x00);
+      for (uint32_t l = 1; l <= 16; l++)
+        out.push_back(l == DC_CODE_LENGTH ? DC_SYMBOLS : 0);
+      for (uint32_t i = 0; i < DC_SYMBOLS; i++)
+        out.push_back((uint8_t)i);
+      out.push_back(0x10);
+      for (uint32_t l = 1; l <= 16; l++)
+        out.push_back(l == AC_CODE_LENGTH ? (uint8_t)symbols.size() : 0);
+      out.insert(out.end(), symbols.begin(), symbols.end());
+    }
+
+    size_t sos_length = 6 + m_components.size() * 2;
+    out.insert(out.end(), {0xFF, 0xDA, (uint8_t)(sos_length >> 8),
+                           (uint8_t)sos_length,
+                           (uint8_t)m_components.size()});
+    for (auto &c : m_components) {
+      out.insert(out.end(),
+                 {c.id, source_tables ? (uint8_t)(c.dc << 4 | c.ac)
+                                      : (uint8_t)0x00});
+    }
+    out.insert(out.end(), {0, 63, 0});
+  };
+
+  std::vector<uint8_t> out;
+  BitReader reader(data.data(), data.size(), 0);
+  JpegIndexPoint state;
+
+  if (m_restart_interval == 0) {
+    // Without restart markers only the DC predictors of the first MCU
+    // differ from the source, so it is re-encoded with the source tables
+    // and the rest of the range is copied bit for bit.
+    BitReader end_reader(data.data(), data.size(), 0);
+    JpegIndexPoint end_state;
+    seek(end_reader, end_state, first + count);
+
+    seek(reader, state, first);
+    write_header(out, true);
+    Encoder encoder(out);
+    encoder.dc = m_dc;
+    encoder.ac = m_ac;
+
+    bool copied = true;
+    try {
+      decode_mcu(reader, state, m_mcu_blocks, m_components, m_dc, m_ac,
+                 m_restart_interval, &encoder);
+    } catch (const std::runtime_error &) {
+      // the source tables may lack a code for a whole DC value
+      copied = false;
+    }
+
+    if (copied) {
+      uint64_t end = end_reader.consumed;
+      while (reader.consumed + 24 <= end)
+        encoder.writer.put(reader.get(24), 24);
+      uint32_t rest = (uint32_t)(end - reader.consumed);
+      encoder.writer.put(reader.get(rest), rest);
+      encoder.writer.flush();
+
+      out.insert(out.end(), {0xFF, 0xD9});
+      return out;
+    }
+  }
+
+  seek(reader, state, first);
+  write_header(out, false);
+  Encoder encoder(out);
+  for (uint32_t row = 0; row < count; row++) {
+    for (uint32_t x = 0; x < m_mcus_per_row; x++) {
+      decode_mcu(reader, state, m_mcu_blocks, m_components, m_dc, m_ac,
+                 m_restart_interval, &encoder);
+    }
+  }
+  encoder.writer.flush();
+
+  out.insert(out.end(), {0xFF, 0xD9});
+  return out;
+}
+
+// Sidecar layout, native endian: magic, version, jpeg file size, content_hash
+// of the jpeg file, width, height, spacing, point count, then the points as
+// stored in memory.
+bool JpegIndex::load(const std::string &path, size_t file_size) {
+  std::ifstream file(path, std::ios_base::binary);
+  if (!file.good())
+    return false;
+
+  char magic[8];
+  uint32_t version;
+  uint64_t jpeg_size;
+  uint64_t hash;
+  uint32_t width;
+  uint32_t height;
+  uint32_t spacing;
+  uint64_t count;
+
+  file.read(magic, sizeof(magic));
+  file.read(reinterpret_cast<char *>(&version), sizeof(version));
+  file.read(reinterpret_cast<char *>(&jpeg_size), sizeof(jpeg_size));
+  file.read(reinterpret_cast<char *>(&hash), sizeof(hash));
+  file.read(reinterpret_cast<char *>(&width), sizeof(width));
+  file.read(reinterpret_cast<char *>(&height), sizeof(height));
+  file.read(reinterpret_cast<char *>(&spacing), sizeof(spacing));
+  file.read(reinterpret_cast<char *>(&count), sizeof(count));
+
+  if (!file.good() || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+      version != INDEX_VERSION || jpeg_size != file_size || hash != m_hash ||
+      width != m_width || height != m_height || spacing == 0 ||
+      count != (m_mcu_rows + spacing - 1) / spacing) {
+    return false;
+  }
+
+  std::vector<JpegIndexPoint> points(count);
+  file.read(reinterpret_cast<char *>(points.data()),
+            count * sizeof(JpegIndexPoint));
+
+  if (!file.good())
+    return false;
+
+  m_spacing = spacing;
+  m_points = std::move(points);
+  return true;
+}
+
+void JpegIndex::save(const std::string &path, size_t file_size) const {
+  // written beside the index and renamed over it, so frames decoding in
+  // parallel never load an index another one is still writing
+  std::string temp = path + "." +
+                     std::to_string(std::hash<std::thread::id>()(
+                         std::this_thread::get_id())) +
+                     ".tmp";
+  std::ofstream file(temp, std::ios_base::binary);
+  if (!file.good())
+    throw std::runtime_error("jpeg_index: Failed to write " + path);
+
+  uint64_t jpeg_size = file_size;
+  uint64_t count = m_points.size();
+
+  file.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  file.write(reinterpret_cast<const char *>(&INDEX_VERSION),
+             sizeof(INDEX_VERSION));
+  file.write(reinterpret_cast<const char *>(&jpeg_size), sizeof(jpeg_size));
+  file.write(reinterpret_cast<const char *>(&m_hash), sizeof(m_hash));
+  file.write(reinterpret_cast<const char *>(&m_width), sizeof(m_width));
+  file.write(reinterpret_cast<const char *>(&m_height), sizeof(m_height));
+  file.write(reinterpret_cast<const char *>(&m_spacing), sizeof(m_spacing));
+  file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+  file.write(reinterpret_cast<const char *>(m_points.data()),
+             count * sizeof(JpegIndexPoint));
+  file.close();
+
+  std::error_code ec;
+  if (file.good())
+    std::filesystem::rename(temp, path, ec);
+  if (!file.good() || ec) {
+    std::filesystem::remove(temp, ec);
+    throw std::runtime_error("jpeg_index: Failed to write " + path);
+  }
+}
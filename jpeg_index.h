@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Entropy decoder state at the start of an MCU row
+struct JpegIndexPoint {
+  uint64_t pos;      // offset of the next byte to load
+  uint64_t consumed; // bits of entropy coded data decoded so far
+  uint64_t bits;
+  uint32_t bit_count;
+  uint32_t marker;
+  uint32_t restarts_left;
+  int32_t dc_pred[4];
+};
+
+// Checkpoints into the entropy coded data of a sequential huffman JPEG every
+// few MCU rows. A range of MCU rows is extracted by re-encoding it into a
+// standalone baseline JPEG that libjpeg can decode on its own, so ranges can
+// be decoded independently of each other and of the rows before them.
+class JpegIndex {
+public:
+  struct HuffTable {
+    uint8_t lookup_len[512];
+    uint8_t lookup_sym[512];
+    int32_t maxcode[18];
+    int32_t mincode[17];
+    int32_t valptr[17];
+    uint8_t vals[256];
+    // code of each symbol for re-encoding, length 0 if it has none
+    uint16_t codes[256];
+    uint8_t code_len[256];
+    bool defined = false;
+  };
+
+  struct Component {
+    uint8_t id;
+    uint8_t h;
+    uint8_t v;
+    uint8_t tq;
+    uint8_t dc;
+    uint8_t ac;
+  };
+
+private:
+  // file offset and length of segments copied into extracted JPEGs
+  std::vector<std::pair<size_t, size_t>> m_segments;
+  std::vector<std::pair<size_t, size_t>> m_tables;
+  std::vector<Component> m_components;
+  HuffTable m_dc[4];
+  HuffTable m_ac[4];
+
+  uint8_t m_sof;
+  uint32_t m_width;
+  uint32_t m_height;
+  uint32_t m_restart_interval = 0;
+  size_t m_scan_start;
+
+  // component of each block of an MCU, in scan order
+  std::vector<uint8_t> m_mcu_blocks;
+  uint32_t m_mcus_per_row;
+  uint32_t m_mcu_rows;
+  uint32_t m_mcu_height;
+
+  // content_hash of the file, checked against the file it is used with
+  uint64_t m_hash;
+  uint32_t m_spacing;
+  std::vector<JpegIndexPoint> m_points;
+
+  void parse(const std::vector<uint8_t> &data);
+  void build(const std::vector<uint8_t> &data);
+  bool load(const std::string &path, size_t file_size);
+
+public:
+  JpegIndex(const std::vector<uint8_t> &data, uint32_t spacing,
+            const std::string &path);
+
+  uint32_t mcu_height() const { return m_mcu_height; };
+  uint32_t mcu_rows() const { return m_mcu_rows; };
+  uint64_t hash() const { return m_hash; };
+
+  std::vector<uint8_t> extract(const std::vector<uint8_t> &data,
+                               uint32_t first, uint32_t count) const;
+
+  void save(const std::string &path, size_t file_size) const;
+};
@@ -0,0 +1,165 @@
+#include "jpeg_stream.h"
+
+#include <algorithm>
+#include <string.h>
+
+std::vector<std::pair<uint64_t, uint64_t>> index_jpeg_stream(std::istream &in) {
+  enum class State {
+    Outside,   // looking for an SOI
+    Marker,    // expecting the 0xFF of the next marker
+    Code,      // expecting the code of a marker
+    Length,    // first byte of a segment length
+    Length2,   // second byte of a segment length
+    Segment,   // skipping the rest of a segment
+    Entropy,   // in entropy coded data
+    EntropyFF, // after a 0xFF in entropy coded data
+  };
+
+  std::vector<std::pair<uint64_t, uint64_t>> frames;
+  State state = State::Outside;
+  bool ff = false;
+  uint64_t start = 0;
+  uint32_t length = 0;
+  uint64_t skip = 0;
+  bool sos = false;
+  bool scanned = false;
+
+  constexpr size_t chunk = 1 << 20;
+  std::vector<uint8_t> buffer(chunk);
+  uint64_t offset = 0;
+
+  while (in) {
+    in.read(reinterpret_cast<char *>(buffer.data()), chunk);
+    size_t size = (size_t)in.gcount();
+    if (size == 0)
+      break;
+    const uint8_t *data = buffer.data();
+    // set when an SOI turns out not to start a JPEG, whose segments may
+    // have skipped over the SOI of the next one
+    bool broken = false;
+
+    for (size_t i = 0; i < size && !broken; i++) {
+      uint8_t b = data[i];
+      switch (state) {
+      case State::Outside: {
+        if (ff && b == 0xD8) {
+          start = offset + i - 1;
+          scanned = false;
+          state = State::Marker;
+          ff = false;
+          break;
+        }
+        if (b != 0xFF) {
+          auto *next =
+              static_cast<const uint8_t *>(memchr(data + i, 0xFF, size - i));
+          i = next ? next - data : size;
+          if (i == size) {
+            ff = false;
+            break;
+          }
+        }
+        ff = true;
+        break;
+      }
+      case State::Marker:
+        if (b == 0xFF)
+          state = State::Code;
+        else
+          broken = true;
+        break;
+      case State::Code:
+        if (b == 0xFF) {
+          // fill byte
+        } else if (b == 0xD8) {
+          start = offset + i - 1;
+          scanned = false;
+          state = State::Marker;
+        } else if (b == 0xD9) {
+          // an EOI before any scan ends a stray SOI in the bytes between
+          if (scanned)
+            frames.push_back({start, offset + i + 1 - start});
+          state = State::Outside;
+        } else if ((b >= 0xD0 && b <= 0xD7) || b == 0x01) {
+          state = State::Marker;
+        } else if (b < 0xC0) {
+          // reserved
+          broken = true;
+        } else {
+          sos = b == 0xDA;
+          state = State::Length;
+        }
+        break;
+      case State::Length:
+        length = b << 8;
+        state = State::Length2;
+        break;
+      case State::Length2:
+        length |= b;
+        if (length < 2) {
+          broken = true;
+        } else if (length == 2) {
+          scanned |= sos;
+          state = sos ? State::Entropy : State::Marker;
+        } else {
+          skip = length - 2;
+          state = State::Segment;
+        }
+        break;
+      case State::Segment: {
+        uint64_t n = std::min<uint64_t>(skip, size - i);
+        skip -= n;
+        i += n - 1;
+        if (skip == 0) {
+          scanned |= sos;
+          state = sos ? State::Entropy : State::Marker;
+        }
+        break;
+      }
+      case State::Entropy: {
+        auto *next =
+            static_cast<const uint8_t *>(memchr(data + i, 0xFF, size - i));
+        if (!next) {
+          i = size;
+          break;
+        }
+        i = next - data;
+        state = State::EntropyFF;
+        break;
+      }
+      case State::EntropyFF:
+        if (b == 0x00 || (b >= 0xD0 && b <= 0xD7)) {
+          state = State::Entropy;
+        } else if (b == 0xFF) {
+          // fill byte
+        } else if (b == 0xD9) {
+          frames.push_back({start, offset + i + 1 - start});
+          state = State::Outside;
+        } else if (b == 0xD8) {
+          start = offset + i - 1;
+          scanned = false;
+          state = State::Marker;
+        } else if (b < 0xC0) {
+          broken = true;
+        } else {
+          // the tables and header of the next scan
+          sos = b == 0xDA;
+          state = State::Length;
+        }
+        break;
+      }
+    }
+
+    if (broken) {
+      // look for the next SOI right after the broken one
+      offset = start + 2;
+      state = State::Outside;
+      ff = false;
+      in.clear();
+      in.seekg(offset);
+    } else {
+      offset += size;
+    }
+  }
+
+  return frames;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <istream>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// Finds the JPEGs of a stream of JPEGs stored back to back, such as a raw
+// Motion JPEG capture, in one pass over the file. Segments are skipped by
+// their length and entropy coded data is scanned for the next marker, so
+// markers inside APP segments and thumbnails don't split frames. Bytes
+// between JPEGs are skipped, and an SOI in them is dropped at the first
+// byte that can't follow it, after which the stream is scanned again from
+// that SOI, so it has to be seekable. A JPEG cut off before its EOI is left
+// out.
+// Returns the offset and size of each JPEG.
+std::vector<std::pair<uint64_t, uint64_t>> index_jpeg_stream(std::istream &in);
@@ -0,0 +1,513 @@
+#include "png_index.h"
+#include "content_hash.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string.h>
+#include <thread>
+#include <zlib.h>
+
+static constexpr size_t WINSIZE = 32768;
+static constexpr char INDEX_MAGIC[8] = {'C', 'S', 'P', 'N', 'G', 'I', 'D', 'X'};
+static constexpr uint32_t INDEX_VERSION = 2;
+
+static uint32_t read_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         (uint32_t)p[3];
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+  int p = a + b - c;
+  int pa = std::abs(p - a);
+  int pb = std::abs(p - b);
+  int pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  if (pb <= pc)
+    return b;
+  return c;
+}
+
+static void unfilter_row(uint8_t filter, uint8_t *row, const uint8_t *prev,
+                         size_t rowbytes, size_t bpp) {
+  switch (filter) {
+  case 0:
+    break;
+  case 1:
+    for (size_t i = bpp; i < rowbytes; i++)
+      row[i] += row[i - bpp];
+    break;
+  case 2:
+    for (size_t i = 0; i < rowbytes; i++)
+      row[i] += prev[i];
+    break;
+  case 3:
+    for (size_t i = 0; i < bpp; i++)
+      row[i] += prev[i] >> 1;
+    for (size_t i = bpp; i < rowbytes; i++)
+      row[i] += (row[i - bpp] + prev[i]) >> 1;
+    break;
+  case 4:
+    for (size_t i = 0; i < bpp; i++)
+      row[i] += prev[i];
+    for (size_t i = bpp; i < rowbytes; i++)
+      row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+    break;
+  default:
+    throw std::runtime_error("Bad PNG filter type");
+  }
+}
+
+namespace {
+// Feeds the IDAT payloads to zlib as one continuous stream
+class IdatInput {
+private:
+  const uint8_t *m_data;
+  const std::vector<std::pair<size_t, size_t>> &m_segments;
+  size_t m_segment = 0;
+  size_t m_skip = 0;
+
+public:
+  IdatInput(const uint8_t *data,
+            const std::vector<std::pair<size_t, size_t>> &segments,
+            uint64_t offset)
+      : m_data(data), m_segments(segments) {
+    while (m_segment < m_segments.size() &&
+           offset >= m_segments[m_segment].second) {
+      offset -= m_segments[m_segment].second;
+      m_segment++;
+    }
+    m_skip = offset;
+  }
+
+  bool feed(z_stream *strm) {
+    if (m_segment >= m_segments.size())
+      return false;
+    auto [offset, length] = m_segments[m_segment++];
+    strm->next_in = const_cast<uint8_t *>(m_data) + offset + m_skip;
+    strm->avail_in = (uInt)(length - m_skip);
+    m_skip = 0;
+    return true;
+  }
+};
+} // namespace
+
+PngIndex::PngIndex(const std::vector<uint8_t> &data, uint32_t spacing,
+                   const std::string &path)
+    : m_hash(content_hash(data)),
+      m_spacing(std::max<uint32_t>(spacing, 1)) {
+  parse(data);
+
+  if (!path.empty() && load(path, data.size()))
+    return;
+
+  build(data);
+
+  if (!path.empty())
+    save(path, data.size());
+}
+
+void PngIndex::parse(const std::vector<uint8_t> &data) {
+  size_t pos = 8;
+  bool have_header = false;
+
+  while (pos + 12 <= data.size()) {
+    uint32_t length = read_be32(data.data() + pos);
+    const uint8_t *type = data.data() + pos + 4;
+    size_t payload = pos + 8;
+    if (payload + length + 4 > data.size())
+      throw std::runtime_error("png_index: Truncated chunk");
+
+    if (memcmp(type, "IHDR", 4) == 0 && length >= 13) {
+      const uint8_t *p = data.data() + payload;
+      m_width = read_be32(p);
+      m_height = read_be32(p + 4);
+      m_bit_depth = p[8];
+      m_color_type = p[9];
+      if (p[12] != 0)
+        throw std::runtime_error("png_index: Interlaced PNGs are not "
+                                 "supported");
+      have_header = true;
+    } else if (memcmp(type, "PLTE", 4) == 0) {
+      m_palette.assign(data.begin() + payload,
+                       data.begin() + payload + length);
+    } else if (memcmp(type, "IDAT", 4) == 0) {
+      m_idat.emplace_back(payload, length);
+      m_idat_size += length;
+    } else if (memcmp(type, "IEND", 4) == 0) {
+      break;
+    }
+
+    pos = payload + length + 4;
+  }
+
+  if (!have_header || m_idat.empty())
+    throw std::runtime_error("png_index: Missing IHDR or IDAT");
+
+  switch (m_color_type) {
+  case 0:
+  case 3:
+    m_channels = 1;
+    break;
+  case 2:
+    m_channels = 3;
+    break;
+  case 4:
+    m_channels = 2;
+    break;
+  case 6:
+    m_channels = 4;
+    break;
+  default:
+    throw std::runtime_error("png_index: Bad color type");
+  }
+
+  m_rowbytes = ((size_t)m_width * m_channels * m_bit_depth + 7) / 8;
+  m_bpp = std::max<size_t>(m_channels * m_bit_depth / 8, 1);
+}
+
+void PngIndex::build(const std::vector<uint8_t> &data) {
+  z_stream strm = {};
+  if (inflateInit(&strm) != Z_OK)
+    throw std::runtime_error("png_index: inflateInit failed");
+
+  IdatInput input(data.data(), m_idat, 0);
+  std::vector<uint8_t> window(WINSIZE);
+
+  const size_t row_size = m_rowbytes + 1;
+  std::vector<uint8_t> row(row_size);
+  std::vector<uint8_t> prev(m_rowbytes);
+  size_t row_fill = 0;
+  uint32_t rows_done = 0;
+
+  // prev_row of the last point is only known once that row is complete
+  bool pending = false;
+
+  uint64_t totin = 0;
+  uint64_t totout = 0;
+  int ret;
+
+  do {
+    if (strm.avail_in == 0 && !input.feed(&strm)) {
+      inflateEnd(&strm);
+      throw std::runtime_error("png_index: Truncated IDAT stream");
+    }
+    if (strm.avail_out == 0) {
+      strm.next_out = window.data();
+      strm.avail_out = WINSIZE;
+    }
+
+    uint8_t *start = strm.next_out;
+    totin += strm.avail_in;
+    totout += strm.avail_out;
+    ret = inflate(&strm, Z_BLOCK);
+    totin -= strm.avail_in;
+    totout -= strm.avail_out;
+
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      inflateEnd(&strm);
+      throw std::runtime_error("png_index: Corrupt IDAT stream");
+    }
+
+    for (uint8_t *p = start; p < strm.next_out && rows_done < m_height;) {
+      size_t n = std::min<size_t>(strm.next_out - p, row_size - row_fill);
+      memcpy(row.data() + row_fill, p, n);
+      row_fill += n;
+      p += n;
+
+      if (row_fill == row_size) {
+        unfilter_row(row[0], row.data() + 1, prev.data(), m_rowbytes, m_bpp);
+        memcpy(prev.data(), row.data() + 1, m_rowbytes);
+        row_fill = 0;
+        rows_done++;
+
+        if (pending && m_points.back().row == rows_done) {
+          m_points.back().prev_row = prev;
+          pending = false;
+        }
+      }
+    }
+
+    if (ret == Z_STREAM_END)
+      break;
+
+    // only the end of a non-final deflate block is a usable access point
+    if ((strm.data_type & 128) && !(strm.data_type & 64)) {
+      uint32_t next_row = (uint32_t)((totout + row_size - 1) / row_size);
+      uint32_t last_row = m_points.empty() ? 0 : m_points.back().row;
+
+      if (next_row < m_height && next_row >= last_row + m_spacing) {
+        PngIndexPoint &point = m_points.emplace_back();
+        point.in = totin;
+        point.out = totout;
+        point.bits = strm.data_type & 7;
+        point.row = next_row;
+
+        size_t left = strm.avail_out;
+        point.window.resize(WINSIZE);
+        memcpy(point.window.data(), window.data() + WINSIZE - left, left);
+        memcpy(point.window.data() + left, window.data(), WINSIZE - left);
+
+        if (next_row == rows_done) {
+          point.prev_row = prev;
+        } else {
+          pending = true;
+        }
+      }
+    }
+  } while (true);
+
+  inflateEnd(&strm);
+
+  if (rows_done < m_height)
+    throw std::runtime_error("png_index: IDAT stream ended early");
+}
+
+uint8_t PngIndex::idat_byte(const uint8_t *data, uint64_t offset) const {
+  for (auto [start, length] : m_idat) {
+    if (offset < length)
+      return data[start + offset];
+    offset -= length;
+  }
+  throw std::runtime_error("png_index: Offset outside of IDAT");
+}
+
+void PngIndex::transform_row(const uint8_t *row, uint8_t *out) const {
+  if (m_color_type == 3) {
+    uint32_t per_byte = 8 / m_bit_depth;
+    uint8_t mask = (1 << m_bit_depth) - 1;
+    for (uint32_t x = 0; x < m_width; x++) {
+      uint32_t shift = 8 - m_bit_depth * (x % per_byte + 1);
+      size_t i = (row[x / per_byte] >> shift) & mask;
+      if (i * 3 + 2 < m_palette.size()) {
+        memcpy(out + x * 3, m_palette.data() + i * 3, 3);
+      } else {
+        memset(out + x * 3, 0, 3);
+      }
+    }
+  } else if (m_bit_depth < 8) {
+    uint32_t per_byte = 8 / m_bit_depth;
+    uint8_t mask = (1 << m_bit_depth) - 1;
+    uint8_t scale = 255 / mask;
+    for (uint32_t x = 0; x < m_width; x++) {
+      uint32_t shift = 8 - m_bit_depth * (x % per_byte + 1);
+      out[x] = ((row[x / per_byte] >> shift) & mask) * scale;
+    }
+  } else if (m_bit_depth == 16) {
+    for (size_t i = 0; i < m_rowbytes; i += 2) {
+      out[i] = row[i + 1];
+      out[i + 1] = row[i];
+    }
+  } else {
+    memcpy(out, row, m_rowbytes);
+  }
+}
+
+void PngIndex::read_rows(const std::vector<uint8_t> &data, uint32_t first,
+                         uint32_t count, uint8_t *out, size_t stride) const {
+  if (count == 0)
+    return;
+
+  auto it = std::upper_bound(
+      m_points.begin(), m_points.end(), first,
+      [](uint32_t row, const PngIndexPoint &point) { return row < point.row; });
+  const PngIndexPoint *point = it == m_points.begin() ? nullptr : &*(it - 1);
+
+  const size_t row_size = m_rowbytes + 1;
+  std::vector<uint8_t> row(row_size);
+  std::vector<uint8_t> prev(m_rowbytes);
+
+  z_stream strm = {};
+  uint64_t skip = 0;
+  uint32_t y = 0;
+
+  if (point) {
+    if (inflateInit2(&strm, -15) != Z_OK)
+      throw std::runtime_error("png_index: inflateInit failed");
+    if (point->bits) {
+      uint8_t ch = idat_byte(data.data(), point->in - 1);
+      inflatePrime(&strm, point->bits, ch >> (8 - point->bits));
+    }
+    inflateSetDictionary(&strm, point->window.data(), WINSIZE);
+
+    skip = (uint64_t)point->row * row_size - point->out;
+    y = point->row;
+    prev = point->prev_row;
+  } else {
+    if (inflateInit(&strm) != Z_OK)
+      throw std::runtime_error("png_index: inflateInit failed");
+  }
+
+  IdatInput input(data.data(), m_idat, point ? point->in : 0);
+  std::vector<uint8_t> buffer(WINSIZE);
+  size_t row_fill = 0;
+
+  while (y < first + count) {
+    if (strm.avail_in == 0 && !input.feed(&strm)) {
+      inflateEnd(&strm);
+      throw std::runtime_error("png_index: Truncated IDAT stream");
+    }
+
+    strm.next_out = buffer.data();
+    strm.avail_out = WINSIZE;
+    int ret = inflate(&strm, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      inflateEnd(&strm);
+      throw std::runtime_error("png_index: Corrupt IDAT stream");
+    }
+
+    uint8_t *p = buffer.data();
+    if (skip > 0) {
+      size_t n = std::min<uint64_t>(skip, strm.next_out - p);
+      skip -= n;
+      p += n;
+    }
+
+    while (p < strm.next_out && y < first + count) {
+      size_t n = std::min<size_t>(strm.next_out - p, row_size - row_fill);
+      memcpy(row.data() + row_fill, p, n);
+      row_fill += n;
+      p += n;
+
+      if (row_fill == row_size) {
+        unfilter_row(row[0], row.data() + 1, prev.data(), m_rowbytes, m_bpp);
+        if (y >= first)
+          transform_row(row.data() + 1, out + (y - first) * stride);
+        memcpy(prev.data(), row.data() + 1, m_rowbytes);
+        row_fill = 0;
+        y++;
+      }
+    }
+
+    if (ret == Z_STREAM_END && y < first + count) {
+      inflateEnd(&strm);
+      throw std::runtime_error("png_index: IDAT stream ended early");
+    }
+  }
+
+  inflateEnd(&strm);
+}
+
+// Sidecar layout, native endian: magic, version, png file size, content_hash
+// of the png file, IDAT size, width, height, spacing, point count, then per
+// point in, out, bits, row, window and prev_row.
+bool PngIndex::load(const std::string &path, size_t file_size) {
+  std::ifstream file(path, std::ios_base::binary);
+  if (!file.good())
+    return false;
+
+  char magic[8];
+  uint32_t version;
+  uint64_t png_size;
+  uint64_t hash;
+  uint64_t idat_size;
+  uint32_t width;
+  uint32_t height;
+  uint32_t spacing;
+  uint64_t count;
+
+  file.read(magic, sizeof(magic));
+  file.read(reinterpret_cast<char *>(&version), sizeof(version));
+  file.read(reinterpret_cast<char *>(&png_size), sizeof(png_size));
+  file.read(reinterpret_cast<char *>(&hash), sizeof(hash));
+  file.read(reinterpret_cast<char *>(&idat_size), sizeof(idat_size));
+  file.read(reinterpret_cast<char *>(&width), sizeof(width));
+  file.read(reinterpret_cast<char *>(&height), sizeof(height));
+  file.read(reinterpret_cast<char *>(&spacing), sizeof(spacing));
+  file.read(reinterpret_cast<char *>(&count), sizeof(count));
+
+  if (!file.good() || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+      version != INDEX_VERSION || png_size != file_size || hash != m_hash ||
+      idat_size != m_idat_size || width != m_width || height != m_height ||
+      spacing != m_spacing) {
+    return false;
+  }
+
+  // a point per spacing rows at most, and all of them in the file, before
+  // anything is allocated for them
+  const size_t point_size = 2 * sizeof(uint64_t) + 2 * sizeof(uint32_t) +
+                            WINSIZE + m_rowbytes;
+  std::error_code ec;
+  uint64_t index_size = std::filesystem::file_size(path, ec);
+  if (ec || count > (m_height + (uint64_t)m_spacing - 1) / m_spacing ||
+      count * point_size > index_size - (uint64_t)file.tellg()) {
+    return false;
+  }
+
+  const size_t row_size = m_rowbytes + 1;
+  std::vector<PngIndexPoint> points(count);
+  uint32_t last_row = 0;
+  for (auto &point : points) {
+    file.read(reinterpret_cast<char *>(&point.in), sizeof(point.in));
+    file.read(reinterpret_cast<char *>(&point.out), sizeof(point.out));
+    file.read(reinterpret_cast<char *>(&point.bits), sizeof(point.bits));
+    file.read(reinterpret_cast<char *>(&point.row), sizeof(point.row));
+    // as build() places them
+    if (!file.good() || point.in == 0 || point.in > m_idat_size ||
+        point.bits >= 8 || point.row < last_row + m_spacing ||
+        point.row >= m_height ||
+        point.row != (point.out + row_size - 1) / row_size) {
+      return false;
+    }
+    last_row = point.row;
+    point.window.resize(WINSIZE);
+    point.prev_row.resize(m_rowbytes);
+    file.read(reinterpret_cast<char *>(point.window.data()), WINSIZE);
+    file.read(reinterpret_cast<char *>(point.prev_row.data()), m_rowbytes);
+  }
+
+  if (!file.good())
+    return false;
+
+  m_points = std::move(points);
+  return true;
+}
+
+void PngIndex::save(const std::string &path, size_t file_size) const {
+  // written beside the index and renamed over it, so frames decoding in
+  // parallel never load an index another one is still writing
+  std::string temp = path + "." +
+                     std::to_string(std::hash<std::thread::id>()(
+                         std::this_thread::get_id())) +
+                     ".tmp";
+  std::ofstream file(temp, std::ios_base::binary);
+  if (!file.good())
+    throw std::runtime_error("png_index: Failed to write " + path);
+
+  uint64_t png_size = file_size;
+  uint64_t count = m_points.size();
+
+  file.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  file.write(reinterpret_cast<const char *>(&INDEX_VERSION),
+             sizeof(INDEX_VERSION));
+  file.write(reinterpret_cast<const char *>(&png_size), sizeof(png_size));
+  file.write(reinterpret_cast<const char *>(&m_hash), sizeof(m_hash));
+  file.write(reinterpret_cast<const char *>(&m_idat_size),
+             sizeof(m_idat_size));
+  file.write(reinterpret_cast<const char *>(&m_width), sizeof(m_width));
+  file.write(reinterpret_cast<const char *>(&m_height), sizeof(m_height));
+  file.write(reinterpret_cast<const char *>(&m_spacing), sizeof(m_spacing));
+  file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+
+  for (auto &point : m_points) {
+    file.write(reinterpret_cast<const char *>(&point.in), sizeof(point.in));
+    file.write(reinterpret_cast<const char *>(&point.out), sizeof(point.out));
+    file.write(reinterpret_cast<const char *>(&point.bits),
+               sizeof(point.bits));
+    file.write(reinterpret_cast<const char *>(&point.row), sizeof(point.row));
+    file.write(reinterpret_cast<const char *>(point.window.data()), WINSIZE);
+    file.write(reinterpret_cast<const char *>(point.prev_row.data()),
+               m_rowbytes);
+  }
+  file.close();
+
+  std::error_code ec;
+  if (file.good())
+    std::filesystem::rename(temp, path, ec);
+  if (!file.good() || ec) {
+    std::filesystem::remove(temp, ec);
+    throw std::runtime_error("png_index: Failed to write " + path);
+  }
+}
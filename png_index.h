@@ -0,0 +1,60 @@
+#pragma once
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Checkpoint into the IDAT stream of a non-interlaced PNG. Holds everything
+// needed to resume inflating at a deflate block boundary and unfiltering at
+// the first row that starts after it.
+struct PngIndexPoint {
+  uint64_t in;  // offset into the concatenated IDAT data
+  uint64_t out; // offset into the inflated scanlines
+  uint32_t bits;
+  uint32_t row; // first row starting at or after out
+  std::vector<uint8_t> window;
+  std::vector<uint8_t> prev_row; // unfiltered row - 1
+};
+
+// zran style random access into the rows of a PNG. Rows are produced in the
+// same layout PngDecodeSession configures libpng for: palette expanded to
+// RGB, gray expanded to 8 bits and 16 bit samples swapped to little endian.
+class PngIndex {
+private:
+  // file offset and length of each IDAT payload
+  std::vector<std::pair<size_t, size_t>> m_idat;
+  uint64_t m_idat_size = 0;
+
+  uint32_t m_width;
+  uint32_t m_height;
+  uint8_t m_bit_depth;
+  uint8_t m_color_type;
+  uint32_t m_channels;
+  size_t m_rowbytes;
+  size_t m_bpp;
+  std::vector<uint8_t> m_palette;
+
+  // content_hash of the file, checked against the file it is used with
+  uint64_t m_hash;
+  uint32_t m_spacing;
+  std::vector<PngIndexPoint> m_points;
+
+  void parse(const std::vector<uint8_t> &data);
+  void build(const std::vector<uint8_t> &data);
+  bool load(const std::string &path, size_t file_size);
+  uint8_t idat_byte(const uint8_t *data, uint64_t offset) const;
+  void transform_row(const uint8_t *row, uint8_t *out) const;
+
+public:
+  PngIndex(const std::vector<uint8_t> &data, uint32_t spacing,
+           const std::string &path);
+
+  uint64_t hash() const { return m_hash; };
+
+  void read_rows(const std::vector<uint8_t> &data, uint32_t first,
+                 uint32_t count, uint8_t *out, size_t stride) const;
+
+  void save(const std::string &path, size_t file_size) const;
+};
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "lcms2.h"
+
+static inline cmsToneCurve *Build_sRGBGamma() {
+  cmsFloat64Number Parameters[5];
+
+  Parameters[0] = 2.4;
+  Parameters[1] = 1. / 1.055;
+  Parameters[2] = 0.055 / 1.055;
+  Parameters[3] = 1. / 12.92;
+  Parameters[4] = 0.04045;
+
+  return cmsBuildParametricToneCurve(NULL, 4, Parameters);
+}
+
+static inline cmsHPROFILE create_sRGB_gray() {
+  cmsToneCurve *gamma22 = Build_sRGBGamma();
+  cmsCIExyY D65 = {0.3127, 0.3290, 1.0};
+  cmsHPROFILE profile = cmsCreateGrayProfile(&D65, gamma22);
+  cmsFreeToneCurve(gamma22);
+  return profile;
+}
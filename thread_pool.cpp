@@ -0,0 +1,202 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+namespace {
+// the pool and queue of a worker thread
+thread_local ThreadPool *current_pool = nullptr;
+thread_local uint32_t current_index = 0;
+} // namespace
+
+ThreadPool::ThreadPool(uint32_t threads) {
+  for (uint32_t i = 0; i < std::max<uint32_t>(threads, 1); i++)
+    queues.push_back(std::make_unique<Queue>());
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cv.notify_all();
+  for (auto &worker : workers)
+    worker.join();
+}
+
+void ThreadPool::push(std::function<void()> task) {
+  std::call_once(started, [&] {
+    for (uint32_t i = 0; i < size(); i++)
+      workers.emplace_back(&ThreadPool::work, this, i);
+  });
+
+  uint32_t index = current_pool == this
+                       ? current_index
+                       : next.fetch_add(1, std::memory_order_relaxed) % size();
+  {
+    std::lock_guard<std::mutex> lock(queues[index]->mutex);
+    queues[index]->tasks.push_back(std::move(task));
+  }
+  // counted once the task can be taken, so a worker that took it first
+  // leaves the count at 0 and sleeping workers aren't woken for nothing
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queued++;
+  }
+  cv.notify_one();
+}
+
+bool ThreadPool::pop(uint32_t index, std::function<void()> *task) {
+  for (uint32_t i = 0; i < size(); i++) {
+    Queue &queue = *queues[(index + i) % size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+      continue;
+    if (i == 0) {
+      *task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      *task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+    queued--;
+    return true;
+  }
+  return false;
+}
+
+bool ThreadPool::run_one() {
+  uint32_t index = current_pool == this
+                       ? current_index
+                       : next.load(std::memory_order_relaxed) % size();
+  std::function<void()> task;
+  if (!pop(index, &task))
+    return false;
+  task();
+  return true;
+}
+
+void ThreadPool::work(uint32_t index) {
+  current_pool = this;
+  current_index = index;
+
+  std::function<void()> task;
+  while (true) {
+    if (pop(index, &task)) {
+      task();
+      task = nullptr;
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return stop || queued > 0; });
+    if (stop && queued <= 0)
+      return;
+  }
+}
+
+TaskGroup::~TaskGroup() {
+  try {
+    wait();
+  } catch (...) {
+  }
+}
+
+void TaskGroup::run(std::function<void()> task) {
+  if (!pool) {
+    local.push_back(std::move(task));
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending++;
+  }
+  pool->push([this, task = std::move(task)] {
+    std::exception_ptr task_error;
+    try {
+      task();
+    } catch (...) {
+      task_error = std::current_exception();
+    }
+    finish(task_error);
+  });
+}
+
+void TaskGroup::finish(std::exception_ptr task_error) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (task_error && !error)
+    error = task_error;
+  if (--pending == 0)
+    cv.notify_all();
+}
+
+void TaskGroup::wait() {
+  for (auto &task : local) {
+    try {
+      task();
+    } catch (...) {
+      if (!error)
+        error = std::current_exception();
+    }
+  }
+  local.clear();
+
+  // the calling thread runs queued tasks, of this group or others, until
+  // the rest of the group's tasks are running elsewhere
+  while (pool) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (pending == 0)
+        break;
+    }
+    if (!pool->run_one()) {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return pending == 0; });
+      break;
+    }
+  }
+
+  std::exception_ptr task_error;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::swap(task_error, error);
+  }
+  if (task_error)
+    std::rethrow_exception(task_error);
+}
+
+void parallel_for(ThreadPool *pool, uint32_t begin, uint32_t end,
+                  uint32_t ranges,
+                  const std::function<void(uint32_t, uint32_t)> &fn) {
+  if (end <= begin)
+    return;
+  uint64_t count = end - begin;
+  ranges = (uint32_t)std::min<uint64_t>(std::max<uint32_t>(ranges, 1), count);
+  auto range = [&](uint32_t r) {
+    fn(begin + (uint32_t)(count * r / ranges),
+       begin + (uint32_t)(count * (r + 1) / ranges));
+  };
+
+  if (!pool || ranges == 1) {
+    for (uint32_t r = 0; r < ranges; r++)
+      range(r);
+    return;
+  }
+
+  TaskGroup group(pool);
+  for (uint32_t r = 1; r < ranges; r++)
+    group.run([&range, r] { range(r); });
+
+  // the calling thread takes the first range, and the others still have to
+  // finish before the ranges' state goes away
+  try {
+    range(0);
+  } catch (...) {
+    try {
+      group.wait();
+    } catch (...) {
+    }
+    throw;
+  }
+  group.wait();
+}
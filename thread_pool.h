@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// Worker threads with a queue of tasks each, started when the first task is
+// queued. Tasks queued by a worker go to its own queue and others are
+// spread over the queues. A worker takes the newest task of its own queue
+// and steals the oldest of another queue when its own is empty.
+class ThreadPool {
+public:
+  explicit ThreadPool(uint32_t threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  uint32_t size() const { return (uint32_t)queues.size(); }
+
+  void push(std::function<void()> task);
+  // Runs one queued task on the calling thread, false if there is none
+  bool run_one();
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  bool pop(uint32_t index, std::function<void()> *task);
+  void work(uint32_t index);
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+  std::once_flag started;
+  std::atomic<uint32_t> next{0};
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  // tasks in the queues
+  std::atomic<int64_t> queued{0};
+  bool stop = false;
+};
+
+// Tasks run on a pool, or on the calling thread in wait() without one.
+// wait() runs queued tasks of the pool until every task of the group has
+// finished and rethrows the first exception of the group's tasks.
+class TaskGroup {
+public:
+  explicit TaskGroup(ThreadPool *pool) : pool(pool) {}
+  ~TaskGroup();
+
+  TaskGroup(const TaskGroup &) = delete;
+  TaskGroup &operator=(const TaskGroup &) = delete;
+
+  void run(std::function<void()> task);
+  void wait();
+
+private:
+  void finish(std::exception_ptr task_error);
+
+  ThreadPool *pool;
+  std::vector<std::function<void()>> local;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  uint32_t pending = 0;
+  std::exception_ptr error;
+};
+
+// Runs fn(start, end) on ranges consecutive ranges splitting [begin, end)
+// evenly, on pool and the calling thread
+void parallel_for(ThreadPool *pool, uint32_t begin, uint32_t end,
+                  uint32_t ranges,
+                  const std::function<void(uint32_t, uint32_t)> &fn);